@@ -0,0 +1,81 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "branch_cache.h"
+
+#define site_index(site) \
+    ((((uintptr_t) site) >> 2) & (BRANCH_CACHE_SITES - 1))
+
+#define target_index(offset) \
+    (((offset) * 0x9E3779B97F4A7C15ULL) >> 56)
+
+branch_cache_t* branch_cache_create() {
+    branch_cache_t* cache = calloc(1, sizeof(branch_cache_t));
+    return cache;
+}
+
+void branch_cache_reset(branch_cache_t* cache) {
+    memset(cache, 0, sizeof(branch_cache_t));
+}
+
+void branch_cache_set_map(branch_cache_t* cache, const uint64_t* map, uint64_t map_size) {
+    // The cached targets were resolved through the previous map
+    if (map != cache->map || map_size != cache->map_size) branch_cache_reset(cache);
+    cache->map = map;
+    cache->map_size = map_size;
+}
+
+// NULL when [offset] is outside the code or does not start an instruction of a remapped stream
+const instruction_t* target_of_offset(branch_cache_t* cache, const instruction_t* code, uint64_t count, reg_t offset) {
+    if (!cache->map) return offset < count ? code + offset : NULL;
+    if (offset >= cache->map_size || cache->map[offset] >= count) return NULL;
+    return code + cache->map[offset];
+}
+
+const instruction_t* resolve_target(branch_cache_t* cache, const instruction_t* code, uint64_t count, reg_t offset) {
+    uint64_t index = target_index(offset);
+    for (uint64_t i = 0; i < BRANCH_TARGETS_SIZE; i += 1) {
+        branch_target_t* entry = &cache->targets[(index + i) & (BRANCH_TARGETS_SIZE - 1)];
+        if (!entry->target) {
+            entry->offset = offset;
+            entry->target = target_of_offset(cache, code, count, offset);
+            return entry->target;
+        }
+        if (entry->offset == offset) return entry->target;
+    }
+
+    // Table full, evict the home slot
+    branch_target_t* entry = &cache->targets[index];
+    entry->offset = offset;
+    entry->target = target_of_offset(cache, code, count, offset);
+    return entry->target;
+}
+
+const instruction_t* branch_cache_lookup(branch_cache_t* cache, const instruction_t* code, uint64_t count, const instruction_t* site, reg_t offset) {
+    branch_site_t* entry = &cache->sites[site_index(site)];
+    if (entry->site == site) {
+        for (uint32_t way = 0; way < BRANCH_CACHE_WAYS; way += 1) {
+            if (entry->targets[way] && entry->offsets[way] == offset) {
+                cache->hits += 1;
+                return entry->targets[way];
+            }
+        }
+    } else {
+        memset(entry, 0, sizeof(branch_site_t));
+        entry->site = site;
+    }
+
+    cache->misses += 1;
+    const instruction_t* target = resolve_target(cache, code, count, offset);
+    if (!target) return NULL;
+    entry->offsets[entry->victim] = offset;
+    entry->targets[entry->victim] = target;
+    entry->victim = (entry->victim + 1) % BRANCH_CACHE_WAYS;
+    return target;
+}
+
+void free_branch_cache(branch_cache_t* cache) {
+    free(cache);
+}
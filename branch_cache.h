@@ -0,0 +1,43 @@
+#ifndef BRANCH_CACHE_H
+#define BRANCH_CACHE_H
+
+#include <stdint.h>
+#include "vm_base.h"
+
+#define BRANCH_CACHE_SITES 64
+#define BRANCH_CACHE_WAYS 4
+#define BRANCH_TARGETS_SIZE 256
+
+// Inline cache of one indirect branch site: the last [BRANCH_CACHE_WAYS] targets seen
+typedef struct {
+    const instruction_t* site;
+    reg_t offsets[BRANCH_CACHE_WAYS];
+    const instruction_t* targets[BRANCH_CACHE_WAYS];
+    uint32_t victim;
+} branch_site_t;
+
+typedef struct {
+    reg_t offset;
+    const instruction_t* target;
+} branch_target_t;
+
+typedef struct {
+    branch_site_t sites[BRANCH_CACHE_SITES];
+    // Open addressing table shared by all the sites, used on inline cache miss
+    branch_target_t targets[BRANCH_TARGETS_SIZE];
+    // Offset to instruction index translation of the compressed streams, NULL otherwise
+    const uint64_t* map;
+    uint64_t map_size;
+    uint64_t hits;
+    uint64_t misses;
+} branch_cache_t;
+
+branch_cache_t* branch_cache_create();
+void branch_cache_reset(branch_cache_t* cache);
+// Resets the cache when the map changes
+void branch_cache_set_map(branch_cache_t* cache, const uint64_t* map, uint64_t map_size);
+// NULL when [offset] is not an instruction of the [count] instructions of [code]
+const instruction_t* branch_cache_lookup(branch_cache_t* cache, const instruction_t* code, uint64_t count, const instruction_t* site, reg_t offset);
+void free_branch_cache(branch_cache_t* cache);
+
+#endif
@@ -0,0 +1,238 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cachesim.h"
+
+#define REPORT_MAX_IPS 32
+
+// 32 KiB 8 ways L1, 1 MiB 16 ways L2, 64 entries 4 ways TLB of 4 KiB pages
+const cachesim_config_t CACHESIM_DEFAULT_CONFIG = {
+    .l1 = {.sets = 64, .ways = 8, .line_size = 64},
+    .l2 = {.sets = 1024, .ways = 16, .line_size = 64},
+    .tlb = {.sets = 16, .ways = 4, .line_size = 4096},
+};
+
+bool_t level_init(cache_level_t* level, cache_config_t config) {
+    if (config.sets == 0 || config.ways == 0) return false;
+    if (config.line_size == 0 || (config.line_size & (config.line_size - 1)) != 0) return false;
+
+    level->config = config;
+    level->line_shift = __builtin_ctz(config.line_size);
+    level->tags = calloc((uint64_t) config.sets * config.ways, sizeof(uint64_t));
+    level->stamps = calloc((uint64_t) config.sets * config.ways, sizeof(uint64_t));
+    level->clock = 0;
+    return level->tags && level->stamps;
+}
+
+void level_free(cache_level_t* level) {
+    free(level->tags);
+    free(level->stamps);
+}
+
+// True on hit, the line is filled on miss
+bool_t level_access(cache_level_t* level, uint64_t address) {
+    uint64_t tag = address >> level->line_shift;
+    uint64_t base = (tag % level->config.sets) * level->config.ways;
+    uint64_t* tags = &level->tags[base];
+    uint64_t* stamps = &level->stamps[base];
+
+    level->clock += 1;
+    uint32_t victim = 0;
+    for (uint32_t way = 0; way < level->config.ways; way += 1) {
+        if (stamps[way] && tags[way] == tag) {
+            stamps[way] = level->clock;
+            return true;
+        }
+        if (stamps[way] < stamps[victim]) victim = way;
+    }
+
+    tags[victim] = tag;
+    stamps[victim] = level->clock;
+    return false;
+}
+
+cachesim_t* cachesim_create(const cachesim_config_t* config) {
+    if (!config) config = &CACHESIM_DEFAULT_CONFIG;
+    cachesim_t* sim = calloc(1, sizeof(cachesim_t));
+    if (!sim) return NULL;
+
+    sim->ips_capacity = 256;
+    sim->ips = calloc(sim->ips_capacity, sizeof(ip_stats_t));
+    bool_t valid = sim->ips != NULL;
+    valid = level_init(&sim->l1, config->l1) && valid;
+    valid = level_init(&sim->l2, config->l2) && valid;
+    valid = level_init(&sim->tlb, config->tlb) && valid;
+    if (!valid) {
+        free_cachesim(sim);
+        return NULL;
+    }
+    return sim;
+}
+
+ip_stats_t* ip_slot(ip_stats_t* ips, uint64_t capacity, uint64_t ip) {
+    uint64_t index = (ip * 0x9E3779B97F4A7C15ULL) & (capacity - 1);
+    while (ips[index].used && ips[index].ip != ip) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return &ips[index];
+}
+
+bool_t ips_grow(cachesim_t* sim) {
+    uint64_t capacity = sim->ips_capacity * 2;
+    ip_stats_t* ips = calloc(capacity, sizeof(ip_stats_t));
+    if (!ips) return false;
+    for (uint64_t i = 0; i < sim->ips_capacity; i += 1) {
+        if (sim->ips[i].used) *ip_slot(ips, capacity, sim->ips[i].ip) = sim->ips[i];
+    }
+    free(sim->ips);
+    sim->ips = ips;
+    sim->ips_capacity = capacity;
+    return true;
+}
+
+ip_stats_t* ip_stats_of(cachesim_t* sim, uint64_t ip) {
+    ip_stats_t* slot = ip_slot(sim->ips, sim->ips_capacity, ip);
+    if (slot->used) return slot;
+    if ((sim->ips_count + 1) * 2 > sim->ips_capacity) {
+        if (!ips_grow(sim)) return NULL;
+        slot = ip_slot(sim->ips, sim->ips_capacity, ip);
+    }
+    slot->used = true;
+    slot->ip = ip;
+    sim->ips_count += 1;
+    return slot;
+}
+
+region_stats_t* region_stats_of(cachesim_t* sim, uint64_t base, const char* name) {
+    for (uint32_t i = 0; i < sim->regions_count; i += 1) {
+        if (sim->regions[i].base == base) return &sim->regions[i];
+    }
+    if (sim->regions_count == CACHESIM_MAX_REGIONS) return NULL;
+    region_stats_t* region = &sim->regions[sim->regions_count++];
+    region->base = base;
+    region->name = name;
+    uint32_t same_name = 0;
+    for (uint32_t i = 0; i + 1 < sim->regions_count; i += 1) {
+        if (!strcmp(sim->regions[i].name, name)) same_name += 1;
+    }
+    if (same_name) {
+        snprintf(region->label, sizeof(region->label), "%s%u", name, same_name + 1);
+    } else {
+        snprintf(region->label, sizeof(region->label), "%s", name);
+    }
+    return region;
+}
+
+uint32_t stride_bucket(uint64_t last, uint64_t address) {
+    uint64_t stride = address >= last ? address - last : last - address;
+    if (stride == 0) return 0;
+    uint32_t bucket = 64 - __builtin_clzll(stride);
+    return bucket < CACHESIM_STRIDE_BUCKETS ? bucket : CACHESIM_STRIDE_BUCKETS - 1;
+}
+
+void add_stats(cache_stats_t* stats, const cache_stats_t* access) {
+    stats->accesses += access->accesses;
+    stats->l1_misses += access->l1_misses;
+    stats->l2_misses += access->l2_misses;
+    stats->tlb_misses += access->tlb_misses;
+}
+
+void cachesim_access(cachesim_t* sim, uint64_t ip, uint64_t address, uint64_t size, uint64_t region, const char* region_name) {
+    cache_stats_t access = {.accesses = 1};
+    uint64_t last_byte = address + size - 1;
+
+    // An unaligned access may touch two lines and two pages
+    uint64_t line_size = sim->l1.config.line_size;
+    for (uint64_t line = address & ~(line_size - 1); line <= last_byte; line += line_size) {
+        if (!level_access(&sim->l1, line)) {
+            access.l1_misses += 1;
+            if (!level_access(&sim->l2, line)) access.l2_misses += 1;
+        }
+    }
+    if (!level_access(&sim->tlb, address)) access.tlb_misses += 1;
+    if ((address >> sim->tlb.line_shift) != (last_byte >> sim->tlb.line_shift)) {
+        if (!level_access(&sim->tlb, last_byte)) access.tlb_misses += 1;
+    }
+
+    add_stats(&sim->total, &access);
+    ip_stats_t* ip_stats = ip_stats_of(sim, ip);
+    if (ip_stats) {
+        if (ip_stats->stats.accesses) ip_stats->strides[stride_bucket(ip_stats->last_address, address)] += 1;
+        ip_stats->last_address = address;
+        add_stats(&ip_stats->stats, &access);
+    }
+    region_stats_t* region_stats = region_stats_of(sim, region, region_name);
+    if (region_stats) add_stats(&region_stats->stats, &access);
+}
+
+double rate(uint64_t misses, uint64_t accesses) {
+    return accesses ? 100.0 * misses / accesses : 0.0;
+}
+
+void report_stats(FILE* out, const cache_stats_t* stats) {
+    fprintf(out, "%12llu %8.2f%% %8.2f%% %8.2f%%",
+        (unsigned long long) stats->accesses,
+        rate(stats->l1_misses, stats->accesses),
+        rate(stats->l2_misses, stats->accesses),
+        rate(stats->tlb_misses, stats->accesses)
+    );
+}
+
+int compare_l1_misses(const void* lhs, const void* rhs) {
+    const ip_stats_t* a = lhs;
+    const ip_stats_t* b = rhs;
+    if (a->stats.l1_misses != b->stats.l1_misses) return a->stats.l1_misses < b->stats.l1_misses ? 1 : -1;
+    return a->ip < b->ip ? -1 : a->ip > b->ip;
+}
+
+void cachesim_report(cachesim_t* sim, FILE* out) {
+    fprintf(out, "%-24s %12s %9s %9s %9s\n", "", "accesses", "l1 miss", "l2 miss", "tlb miss");
+    fprintf(out, "%-24s ", "total");
+    report_stats(out, &sim->total);
+    fprintf(out, "\n\nregions\n");
+    for (uint32_t i = 0; i < sim->regions_count; i += 1) {
+        const region_stats_t* region = &sim->regions[i];
+        fprintf(out, "%-10s %#-13llx ", region->label, (unsigned long long) region->base);
+        report_stats(out, &region->stats);
+        fprintf(out, "\n");
+    }
+
+    ip_stats_t* ips = malloc(sim->ips_count * sizeof(ip_stats_t) + 1);
+    if (!ips) return;
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < sim->ips_capacity; i += 1) {
+        if (sim->ips[i].used) ips[count++] = sim->ips[i];
+    }
+    qsort(ips, count, sizeof(ip_stats_t), compare_l1_misses);
+
+    fprintf(out, "\nip (most l1 misses first), strides as log2 bucket:count\n");
+    for (uint64_t i = 0; i < count && i < REPORT_MAX_IPS; i += 1) {
+        fprintf(out, "ip %-21llu ", (unsigned long long) ips[i].ip);
+        report_stats(out, &ips[i].stats);
+        fprintf(out, "  ");
+        for (uint32_t bucket = 0; bucket < CACHESIM_STRIDE_BUCKETS; bucket += 1) {
+            if (ips[i].strides[bucket]) fprintf(out, " %u:%llu", bucket, (unsigned long long) ips[i].strides[bucket]);
+        }
+        fprintf(out, "\n");
+    }
+    free(ips);
+}
+
+void cachesim_reset(cachesim_t* sim) {
+    memset(&sim->total, 0, sizeof(sim->total));
+    memset(sim->ips, 0, sim->ips_capacity * sizeof(ip_stats_t));
+    sim->ips_count = 0;
+    memset(sim->regions, 0, sizeof(sim->regions));
+    sim->regions_count = 0;
+}
+
+void free_cachesim(cachesim_t* sim) {
+    level_free(&sim->l1);
+    level_free(&sim->l2);
+    level_free(&sim->tlb);
+    free(sim->ips);
+    free(sim);
+}
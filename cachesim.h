@@ -0,0 +1,79 @@
+#ifndef CACHESIM_H
+#define CACHESIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "util.h"
+
+#define CACHESIM_STRIDE_BUCKETS 16
+#define CACHESIM_MAX_REGIONS 32
+#define CACHESIM_REGION_NAME 16
+
+typedef struct {
+    uint32_t sets;
+    uint32_t ways;
+    // Page size for a TLB
+    uint32_t line_size;
+} cache_config_t;
+
+typedef struct {
+    cache_config_t l1;
+    cache_config_t l2;
+    cache_config_t tlb;
+} cachesim_config_t;
+
+// Set associative level with LRU replacement
+typedef struct {
+    cache_config_t config;
+    uint32_t line_shift;
+    uint64_t* tags;
+    uint64_t* stamps;
+    uint64_t clock;
+} cache_level_t;
+
+typedef struct {
+    uint64_t accesses;
+    uint64_t l1_misses;
+    uint64_t l2_misses;
+    uint64_t tlb_misses;
+} cache_stats_t;
+
+typedef struct {
+    uint64_t ip;
+    bool_t used;
+    cache_stats_t stats;
+    uint64_t last_address;
+    // Bucket 0 is a zero stride, bucket n a stride in [2^(n-1), 2^n) bytes
+    uint64_t strides[CACHESIM_STRIDE_BUCKETS];
+} ip_stats_t;
+
+typedef struct {
+    uint64_t base;
+    // Name given by the caller, regions sharing it are told apart by a number in [label]
+    const char* name;
+    char label[CACHESIM_REGION_NAME];
+    cache_stats_t stats;
+} region_stats_t;
+
+typedef struct {
+    cache_level_t l1;
+    cache_level_t l2;
+    cache_level_t tlb;
+    cache_stats_t total;
+    ip_stats_t* ips;
+    uint64_t ips_capacity;
+    uint64_t ips_count;
+    region_stats_t regions[CACHESIM_MAX_REGIONS];
+    uint32_t regions_count;
+} cachesim_t;
+
+extern const cachesim_config_t CACHESIM_DEFAULT_CONFIG;
+
+cachesim_t* cachesim_create(const cachesim_config_t* config);
+void cachesim_access(cachesim_t* sim, uint64_t ip, uint64_t address, uint64_t size, uint64_t region, const char* region_name);
+void cachesim_report(cachesim_t* sim, FILE* out);
+// Drops the statistics, the simulated caches stay warm like the real ones between requests
+void cachesim_reset(cachesim_t* sim);
+void free_cachesim(cachesim_t* sim);
+
+#endif
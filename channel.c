@@ -0,0 +1,166 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel.h"
+
+vm_channel_t* channel_create(channel_kind_t kind, uint64_t capacity) {
+    uint64_t size = 2;
+    while (size < capacity) size *= 2;
+
+    void* memory;
+    if (posix_memalign(&memory, CHANNEL_CACHE_LINE, sizeof(vm_channel_t)) != 0) return NULL;
+    vm_channel_t* channel = memory;
+    channel->slots = calloc(size, sizeof(channel_slot_t));
+    if (!channel->slots) {
+        free(channel);
+        return NULL;
+    }
+
+    channel->kind = kind;
+    channel->mask = size - 1;
+    atomic_init(&channel->head, 0);
+    atomic_init(&channel->tail, 0);
+    for (uint64_t i = 0; i < size; i += 1) {
+        atomic_init(&channel->slots[i].sequence, i);
+    }
+    return channel;
+}
+
+void slot_write(channel_slot_t* slot, const channel_message_t* message) {
+    slot->size = message->size;
+    slot->writable = message->writable;
+    slot->owned = message->owned;
+    if (message->size <= CHANNEL_INLINE_SIZE) {
+        slot->handoff = NULL;
+        memcpy(slot->payload, message->data, message->size);
+    } else {
+        slot->handoff = (uint8_t*) message->data;
+    }
+}
+
+channel_status_t slot_check(const channel_slot_t* slot, uint64_t capacity) {
+    return !slot->handoff && slot->size > capacity ? CHANNEL_TOO_LARGE : CHANNEL_OK;
+}
+
+void slot_read(const channel_slot_t* slot, uint8_t* buffer, channel_message_t* message) {
+    message->size = slot->size;
+    message->writable = slot->writable;
+    message->owned = slot->owned;
+    if (slot->handoff) {
+        message->data = slot->handoff;
+    } else {
+        memcpy(buffer, slot->payload, slot->size);
+        message->data = buffer;
+    }
+}
+
+uint64_t spsc_send(vm_channel_t* channel, const channel_message_t* messages, uint64_t count) {
+    uint64_t tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&channel->head, memory_order_acquire);
+    uint64_t available = channel->mask + 1 - (tail - head);
+    uint64_t sent = count < available ? count : available;
+    for (uint64_t i = 0; i < sent; i += 1) {
+        slot_write(&channel->slots[(tail + i) & channel->mask], &messages[i]);
+    }
+    // A single release publishes the whole batch
+    if (sent) atomic_store_explicit(&channel->tail, tail + sent, memory_order_release);
+    return sent;
+}
+
+channel_status_t spsc_receive(vm_channel_t* channel, uint8_t* buffer, uint64_t capacity, channel_message_t* message) {
+    uint64_t head = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&channel->tail, memory_order_acquire);
+    if (head == tail) return CHANNEL_WOULD_BLOCK;
+
+    const channel_slot_t* slot = &channel->slots[head & channel->mask];
+    channel_status_t status = slot_check(slot, capacity);
+    if (status != CHANNEL_OK) return status;
+    slot_read(slot, buffer, message);
+    atomic_store_explicit(&channel->head, head + 1, memory_order_release);
+    return CHANNEL_OK;
+}
+
+// Bounded MPMC queue of Dmitry Vyukov: a slot is free for position p when its sequence is p,
+// and holds the message of position p when its sequence is p + 1
+channel_status_t mpmc_send(vm_channel_t* channel, const channel_message_t* message) {
+    uint64_t position = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+    channel_slot_t* slot;
+    while (true) {
+        slot = &channel->slots[position & channel->mask];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int64_t diff = (int64_t) (sequence - position);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&channel->tail, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return CHANNEL_WOULD_BLOCK;
+        } else {
+            position = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+        }
+    }
+
+    slot_write(slot, message);
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+    return CHANNEL_OK;
+}
+
+channel_status_t mpmc_receive(vm_channel_t* channel, uint8_t* buffer, uint64_t capacity, channel_message_t* message) {
+    uint64_t position = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    channel_slot_t* slot;
+    while (true) {
+        slot = &channel->slots[position & channel->mask];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int64_t diff = (int64_t) (sequence - (position + 1));
+        if (diff == 0) {
+            // A failed check leaves the message in place, unless another consumer took it meanwhile
+            channel_status_t status = slot_check(slot, capacity);
+            if (status != CHANNEL_OK) {
+                uint64_t head = atomic_load_explicit(&channel->head, memory_order_relaxed);
+                if (head == position) return status;
+                position = head;
+                continue;
+            }
+            if (atomic_compare_exchange_weak_explicit(&channel->head, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return CHANNEL_WOULD_BLOCK;
+        } else {
+            position = atomic_load_explicit(&channel->head, memory_order_relaxed);
+        }
+    }
+
+    slot_read(slot, buffer, message);
+    atomic_store_explicit(&slot->sequence, position + channel->mask + 1, memory_order_release);
+    return CHANNEL_OK;
+}
+
+channel_status_t channel_try_send(vm_channel_t* channel, const channel_message_t* message) {
+    if (channel->kind == CHANNEL_MPMC) return mpmc_send(channel, message);
+    return spsc_send(channel, message, 1) ? CHANNEL_OK : CHANNEL_WOULD_BLOCK;
+}
+
+uint64_t channel_try_send_batch(vm_channel_t* channel, const channel_message_t* messages, uint64_t count) {
+    if (channel->kind == CHANNEL_SPSC) return spsc_send(channel, messages, count);
+    uint64_t sent = 0;
+    while (sent < count && mpmc_send(channel, &messages[sent]) == CHANNEL_OK) {
+        sent += 1;
+    }
+    return sent;
+}
+
+channel_status_t channel_try_receive(vm_channel_t* channel, uint8_t* buffer, uint64_t capacity, channel_message_t* message) {
+    if (channel->kind == CHANNEL_MPMC) return mpmc_receive(channel, buffer, capacity, message);
+    return spsc_receive(channel, buffer, capacity, message);
+}
+
+void free_channel(vm_channel_t* channel) {
+    // Nobody uses the channel anymore, every position between head and tail holds a message
+    uint64_t tail = atomic_load_explicit(&channel->tail, memory_order_acquire);
+    for (uint64_t position = channel->head; position != tail; position += 1) {
+        channel_slot_t* slot = &channel->slots[position & channel->mask];
+        if (slot->handoff && slot->owned) free(slot->handoff);
+    }
+    free(channel->slots);
+    free(channel);
+}
@@ -0,0 +1,65 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "util.h"
+
+// Payloads up to this size are copied in the slot, larger ones are handed off
+#define CHANNEL_INLINE_SIZE 48
+#define CHANNEL_CACHE_LINE 64
+
+typedef enum {
+    CHANNEL_SPSC,
+    CHANNEL_MPMC
+} channel_kind_t;
+
+typedef enum {
+    CHANNEL_OK,
+    // Full on send, empty on receive
+    CHANNEL_WOULD_BLOCK,
+    // The inline payload does not fit in the receive buffer, the message stays in the channel
+    CHANNEL_TOO_LARGE
+} channel_status_t;
+
+typedef struct {
+    // Vyukov sequence number, only used by CHANNEL_MPMC
+    _Atomic uint64_t sequence;
+    uint64_t size;
+    // Host address of the payload when it is handed off, NULL when it is inline
+    uint8_t* handoff;
+    // The sender could write the handed off memory, the receiver gets the same access
+    bool_t writable;
+    // The handed off memory was allocated for the message, the receiver frees it
+    bool_t owned;
+    uint8_t payload[CHANNEL_INLINE_SIZE];
+} channel_slot_t;
+
+// Bounded ring buffer shared by vms running on different threads
+typedef struct {
+    _Alignas(CHANNEL_CACHE_LINE) _Atomic uint64_t head;
+    _Alignas(CHANNEL_CACHE_LINE) _Atomic uint64_t tail;
+    _Alignas(CHANNEL_CACHE_LINE) channel_kind_t kind;
+    uint64_t mask;
+    channel_slot_t* slots;
+} vm_channel_t;
+
+typedef struct {
+    const uint8_t* data;
+    uint64_t size;
+    bool_t writable;
+    // [data] comes from malloc, whoever receives the message frees it
+    bool_t owned;
+} channel_message_t;
+
+// [capacity] is rounded up to a power of two
+vm_channel_t* channel_create(channel_kind_t kind, uint64_t capacity);
+channel_status_t channel_try_send(vm_channel_t* channel, const channel_message_t* message);
+// Number of messages sent, stops at the first one that does not fit
+uint64_t channel_try_send_batch(vm_channel_t* channel, const channel_message_t* messages, uint64_t count);
+// An inline payload is copied to [buffer], [message] points to [buffer] or to the handed off memory
+channel_status_t channel_try_receive(vm_channel_t* channel, uint8_t* buffer, uint64_t capacity, channel_message_t* message);
+// Frees the owned payloads of the messages nobody received
+void free_channel(vm_channel_t* channel);
+
+#endif
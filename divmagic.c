@@ -0,0 +1,143 @@
+#include <stdint.h>
+
+#include "divmagic.h"
+
+#define SHIFT_MASK 0x3F
+#define ADD_MARKER 0x40
+#define NEGATIVE_DIVISOR 0x80
+
+uint64_t mulhi_u64(uint64_t x, uint64_t y) {
+    return (uint64_t) (((__uint128_t) x * y) >> 64);
+}
+
+int64_t mulhi_s64(int64_t x, int64_t y) {
+    return (int64_t) (((__int128_t) x * y) >> 64);
+}
+
+uint32_t floor_log2(uint64_t value) {
+    return 63 - __builtin_clzll(value);
+}
+
+div_magic_t udiv_magic(uint64_t divisor) {
+    div_magic_t magic = {.divisor = divisor, .magic = 0, .more = 0};
+    if (divisor == 0) return magic;
+
+    uint32_t log = floor_log2(divisor);
+    if ((divisor & (divisor - 1)) == 0) {
+        magic.more = log;
+        return magic;
+    }
+
+    __uint128_t power = (__uint128_t) 1 << (64 + log);
+    uint64_t proposed = (uint64_t) (power / divisor);
+    uint64_t rem = (uint64_t) (power % divisor);
+    uint64_t e = divisor - rem;
+    if (e < ((uint64_t) 1 << log)) {
+        magic.more = log;
+    } else {
+        // 65 bits magic number: the shift is done with an extra add
+        proposed += proposed;
+        uint64_t twice_rem = rem + rem;
+        if (twice_rem >= divisor || twice_rem < rem) proposed += 1;
+        magic.more = log | ADD_MARKER;
+    }
+    magic.magic = proposed + 1;
+    return magic;
+}
+
+div_magic_t sdiv_magic(int64_t divisor) {
+    div_magic_t magic = {.divisor = (uint64_t) divisor, .magic = 0, .more = 0};
+    if (divisor == 0) return magic;
+
+    uint64_t abs_divisor = divisor < 0 ? -(uint64_t) divisor : (uint64_t) divisor;
+    uint32_t log = floor_log2(abs_divisor);
+    uint8_t negative = divisor < 0 ? NEGATIVE_DIVISOR : 0;
+    if ((abs_divisor & (abs_divisor - 1)) == 0) {
+        magic.more = log | negative;
+        return magic;
+    }
+
+    __uint128_t power = (__uint128_t) 1 << (63 + log);
+    uint64_t proposed = (uint64_t) (power / abs_divisor);
+    uint64_t rem = (uint64_t) (power % abs_divisor);
+    uint64_t e = abs_divisor - rem;
+    if (e < ((uint64_t) 1 << log)) {
+        magic.more = log - 1;
+    } else {
+        proposed += proposed;
+        uint64_t twice_rem = rem + rem;
+        if (twice_rem >= abs_divisor || twice_rem < rem) proposed += 1;
+        magic.more = log | ADD_MARKER;
+    }
+    proposed += 1;
+    magic.magic = negative ? -proposed : proposed;
+    magic.more |= negative;
+    return magic;
+}
+
+uint64_t udiv_magic_do(uint64_t numerator, const div_magic_t* magic) {
+    if (magic->divisor == 0) return UINT64_MAX;
+    uint8_t shift = magic->more & SHIFT_MASK;
+    if (!magic->magic) return numerator >> shift;
+
+    uint64_t q = mulhi_u64(magic->magic, numerator);
+    if (magic->more & ADD_MARKER) {
+        uint64_t t = ((numerator - q) >> 1) + q;
+        return t >> shift;
+    }
+    return q >> shift;
+}
+
+int64_t sdiv_magic_do(int64_t numerator, const div_magic_t* magic) {
+    if (magic->divisor == 0) return -1;
+    uint8_t shift = magic->more & SHIFT_MASK;
+    // All ones when the divisor is negative, 0 otherwise
+    uint64_t sign = (magic->more & NEGATIVE_DIVISOR) ? UINT64_MAX : 0;
+
+    if (!magic->magic) {
+        uint64_t mask = ((uint64_t) 1 << shift) - 1;
+        uint64_t uq = (uint64_t) numerator + (((uint64_t) (numerator >> 63)) & mask);
+        uint64_t q = (uint64_t) (((int64_t) uq) >> shift);
+        return (int64_t) ((q ^ sign) - sign);
+    }
+
+    uint64_t uq = (uint64_t) mulhi_s64((int64_t) magic->magic, numerator);
+    if (magic->more & ADD_MARKER) {
+        uq += ((uint64_t) numerator ^ sign) - sign;
+    }
+    int64_t q = ((int64_t) uq) >> shift;
+    return (int64_t) ((uint64_t) q + (q < 0));
+}
+
+uint64_t umod_magic_do(uint64_t numerator, const div_magic_t* magic) {
+    if (magic->divisor == 0) return numerator;
+    return numerator - udiv_magic_do(numerator, magic) * magic->divisor;
+}
+
+int64_t smod_magic_do(int64_t numerator, const div_magic_t* magic) {
+    if (magic->divisor == 0) return numerator;
+    uint64_t q = (uint64_t) sdiv_magic_do(numerator, magic);
+    return (int64_t) ((uint64_t) numerator - q * magic->divisor);
+}
+
+uint64_t udiv64(uint64_t numerator, uint64_t divisor) {
+    if (divisor == 0) return UINT64_MAX;
+    return numerator / divisor;
+}
+
+int64_t sdiv64(int64_t numerator, int64_t divisor) {
+    if (divisor == 0) return -1;
+    if (divisor == -1) return (int64_t) -(uint64_t) numerator;
+    return numerator / divisor;
+}
+
+uint64_t umod64(uint64_t numerator, uint64_t divisor) {
+    if (divisor == 0) return numerator;
+    return numerator % divisor;
+}
+
+int64_t smod64(int64_t numerator, int64_t divisor) {
+    if (divisor == 0) return numerator;
+    if (divisor == -1) return 0;
+    return numerator % divisor;
+}
@@ -0,0 +1,28 @@
+#ifndef DIVMAGIC_H
+#define DIVMAGIC_H
+
+#include <stdint.h>
+
+// Division by an invariant divisor as a multiply-high and a shift
+// (Granlund-Montgomery, as laid out by libdivide)
+typedef struct {
+    uint64_t divisor;
+    uint64_t magic;
+    uint8_t more;
+} div_magic_t;
+
+div_magic_t udiv_magic(uint64_t divisor);
+div_magic_t sdiv_magic(int64_t divisor);
+uint64_t udiv_magic_do(uint64_t numerator, const div_magic_t* magic);
+int64_t sdiv_magic_do(int64_t numerator, const div_magic_t* magic);
+uint64_t umod_magic_do(uint64_t numerator, const div_magic_t* magic);
+int64_t smod_magic_do(int64_t numerator, const div_magic_t* magic);
+
+// Hardware division with the vm semantic:
+// x / 0 = -1, x % 0 = x, INT64_MIN / -1 = INT64_MIN, INT64_MIN % -1 = 0
+uint64_t udiv64(uint64_t numerator, uint64_t divisor);
+int64_t sdiv64(int64_t numerator, int64_t divisor);
+uint64_t umod64(uint64_t numerator, uint64_t divisor);
+int64_t smod64(int64_t numerator, int64_t divisor);
+
+#endif
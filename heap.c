@@ -0,0 +1,130 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "heap.h"
+
+#define BLOCK_USED 0x55534544
+#define BLOCK_FREE 0x46524545
+
+typedef struct {
+    uint32_t size_class;
+    uint32_t state;
+    uint64_t padding;
+} block_header_t;
+
+uint32_t size_class_of(uint64_t size) {
+    uint64_t block_size = size + HEAP_HEADER_SIZE;
+    if (block_size <= (1 << HEAP_MIN_CLASS)) return HEAP_MIN_CLASS;
+    return 64 - __builtin_clzll(block_size - 1);
+}
+
+block_header_t* header_of(vm_heap_t* heap, void* pointer) {
+    uint8_t* block = (uint8_t*) pointer - HEAP_HEADER_SIZE;
+    if (!heap->arena || block < heap->arena || block >= heap->arena + heap->top) return NULL;
+    if ((block - heap->arena) % (1 << HEAP_MIN_CLASS) != 0) return NULL;
+
+    block_header_t* header = (block_header_t*) block;
+    if (header->size_class < HEAP_MIN_CLASS || header->size_class >= HEAP_CLASSES) return NULL;
+    // Headers live in guest memory: a forged one must not describe a block past the arena
+    if (block + ((uint64_t) 1 << header->size_class) > heap->arena + heap->top) return NULL;
+    return header;
+}
+
+#define LINKS_SIZE ((VM_HEAP_SIZE >> HEAP_MIN_CLASS) * sizeof(uint32_t))
+
+bool_t heap_reserve(vm_heap_t* heap) {
+    uint8_t* arena = mmap(NULL, VM_HEAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (arena == MAP_FAILED) return false;
+    uint32_t* links = mmap(NULL, LINKS_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (links == MAP_FAILED) {
+        munmap(arena, VM_HEAP_SIZE);
+        return false;
+    }
+    heap->arena = arena;
+    heap->links = links;
+    heap->capacity = VM_HEAP_SIZE;
+    heap->top = 0;
+    return true;
+}
+
+uint64_t unit_of(vm_heap_t* heap, uint8_t* block) {
+    return (block - heap->arena) >> HEAP_MIN_CLASS;
+}
+
+void* heap_alloc(vm_heap_t* heap, uint64_t size) {
+    if (size > VM_HEAP_SIZE / 2 - HEAP_HEADER_SIZE) return NULL;
+    if (!heap->arena && !heap_reserve(heap)) return NULL;
+
+    uint32_t size_class = size_class_of(size);
+    uint8_t* block = heap->free_lists[size_class];
+    if (block) {
+        uint32_t next = heap->links[unit_of(heap, block)];
+        heap->free_lists[size_class] = next ? heap->arena + ((uint64_t) (next - 1) << HEAP_MIN_CLASS) : NULL;
+    } else {
+        // Every block size is a multiple of the smallest one, so blocks stay aligned on it
+        uint64_t block_size = (uint64_t) 1 << size_class;
+        if (heap->top + block_size > heap->capacity) return NULL;
+        block = heap->arena + heap->top;
+        heap->top += block_size;
+    }
+
+    block_header_t* header = (block_header_t*) block;
+    header->size_class = size_class;
+    header->state = BLOCK_USED;
+    return block + HEAP_HEADER_SIZE;
+}
+
+bool_t heap_free(vm_heap_t* heap, void* pointer) {
+    if (!pointer) return true;
+    block_header_t* header = header_of(heap, pointer);
+    if (!header || header->state != BLOCK_USED) return false;
+
+    header->state = BLOCK_FREE;
+    uint8_t* head = heap->free_lists[header->size_class];
+    heap->links[unit_of(heap, (uint8_t*) header)] = head ? unit_of(heap, head) + 1 : 0;
+    heap->free_lists[header->size_class] = (uint8_t*) header;
+    return true;
+}
+
+void* heap_realloc(vm_heap_t* heap, void* pointer, uint64_t size, bool_t* valid) {
+    *valid = true;
+    if (!pointer) return heap_alloc(heap, size);
+
+    block_header_t* header = header_of(heap, pointer);
+    if (!header || header->state != BLOCK_USED) {
+        *valid = false;
+        return NULL;
+    }
+    if (size == 0) {
+        heap_free(heap, pointer);
+        return NULL;
+    }
+
+    uint64_t usable = ((uint64_t) 1 << header->size_class) - HEAP_HEADER_SIZE;
+    if (size <= usable) return pointer;
+
+    void* resized = heap_alloc(heap, size);
+    if (!resized) return NULL;
+    memcpy(resized, pointer, usable);
+    heap_free(heap, pointer);
+    return resized;
+}
+
+void heap_reset(vm_heap_t* heap) {
+    if (!heap->arena) return;
+    // Every block goes back at once, only the pages below [top] can be dirty
+    madvise(heap->arena, alignn(heap->top, sysconf(_SC_PAGESIZE)), MADV_DONTNEED);
+    heap->top = 0;
+    memset(heap->free_lists, 0, sizeof(heap->free_lists));
+}
+
+void free_heap(vm_heap_t* heap) {
+    if (heap->arena) {
+        munmap(heap->arena, heap->capacity);
+        munmap(heap->links, LINKS_SIZE);
+    }
+    heap->arena = NULL;
+}
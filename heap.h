@@ -0,0 +1,32 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stdint.h>
+#include "util.h"
+
+#define VM_HEAP_SIZE (64 * 1024 * 1024)
+// Blocks are powers of two from 32 bytes to half of the arena, header included
+#define HEAP_MIN_CLASS 5
+#define HEAP_CLASSES 26
+#define HEAP_HEADER_SIZE 16
+
+// Size class allocator over an arena reserved on the first allocation,
+// a vm runs on one thread at a time so the free lists need no locking
+typedef struct {
+    uint8_t* arena;
+    uint64_t capacity;
+    // Bump offset, everything past it has never been handed out since the last reset
+    uint64_t top;
+    // Next free block of each free block, in host memory so the guest cannot redirect an
+    // allocation: index of the next block in smallest blocks plus one, 0 ends the list
+    uint32_t* links;
+    uint8_t* free_lists[HEAP_CLASSES];
+} vm_heap_t;
+
+void* heap_alloc(vm_heap_t* heap, uint64_t size);
+bool_t heap_free(vm_heap_t* heap, void* pointer);
+void* heap_realloc(vm_heap_t* heap, void* pointer, uint64_t size, bool_t* valid);
+void heap_reset(vm_heap_t* heap);
+void free_heap(vm_heap_t* heap);
+
+#endif
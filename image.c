@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "vm.h"
+
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+
+uint64_t image_key(const instruction_t* code, uint64_t count) {
+    const char* build_id = VM_BUILD_ID;
+    uint64_t entry_size = sizeof(prepared_instruction_t);
+    uint64_t hash = fnv1a(build_id, strlen(build_id), FNV_OFFSET);
+    hash = fnv1a(&entry_size, sizeof(entry_size), hash);
+    return fnv1a(code, count * sizeof(instruction_t), hash);
+}
+
+uint64_t image_size(uint64_t count) {
+    return sizeof(prepared_header_t) + count * sizeof(prepared_instruction_t);
+}
+
+prepared_image_t* image_of_memory(const instruction_t* code, uint64_t count, void* memory, bool_t is_mapped) {
+    prepared_image_t* image = malloc(sizeof(prepared_image_t));
+    if (!image) return NULL;
+    image->code = code;
+    image->count = count;
+    image->header = memory;
+    image->instructions = (const prepared_instruction_t*) ((uint8_t*) memory + sizeof(prepared_header_t));
+    image->memory = memory;
+    image->memory_size = image_size(count);
+    image->is_mapped = is_mapped;
+    return image;
+}
+
+prepared_image_t* image_prepare(const instruction_t* code, uint64_t count) {
+    void* memory = calloc(1, image_size(count));
+    if (!memory) return NULL;
+
+    prepared_header_t* header = memory;
+    header->magic = VM_IMAGE_MAGIC;
+    header->version = VM_IMAGE_VERSION;
+    header->key = image_key(code, count);
+    header->count = count;
+
+    prepared_instruction_t* instructions = (prepared_instruction_t*) (header + 1);
+    for (uint64_t i = 0; i < count; i += 1) {
+        vm_prepare_instruction(code[i], i, count, &instructions[i]);
+    }
+
+    prepared_image_t* image = image_of_memory(code, count, memory, false);
+    if (!image) free(memory);
+    return image;
+}
+
+void image_path(char* path, uint64_t size, const char* cache_dir, uint64_t key) {
+    snprintf(path, size, "%s/%016llx.vmi", cache_dir, (unsigned long long) key);
+}
+
+// The decoded fields come from disk, nothing they index may leave the vm
+bool_t prepared_valid(const prepared_instruction_t* prepared, instruction_t instruction, uint64_t count) {
+    if (prepared->instruction != instruction) return false;
+    if (!(prepared->flags & PREPARED_VALID)) return true;
+    if (prepared->opcode != (instruction >> 27)) return false;
+    if (prepared->dst >= 16 || prepared->lhs >= 16 || prepared->rhs >= 16 || prepared->data_size > S64) return false;
+    switch (prepared->opcode) {
+    case BR_JUMP:
+        return prepared->immediate >= 0 && (uint64_t) prepared->immediate < count;
+    case DIV:
+    case MOD: {
+        bool_t is_unsigned = (prepared->flags & PREPARED_UNSIGNED) != 0;
+        if (is_unsigned != ((instruction >> 26) & 1)) return false;
+        if (prepared->flags & PREPARED_REGISTER) return true;
+        // Cheap to recompute, and a wrong magic gives wrong quotients without any fault
+        div_magic_t magic = is_unsigned ? udiv_magic(prepared->immediate) : sdiv_magic(prepared->immediate);
+        return prepared->magic.divisor == magic.divisor && prepared->magic.magic == magic.magic &&
+            prepared->magic.more == magic.more;
+    }
+    default:
+        return true;
+    }
+}
+
+bool_t image_valid(const prepared_image_t* image, uint64_t key) {
+    const prepared_header_t* header = image->header;
+    if (header->magic != VM_IMAGE_MAGIC || header->version != VM_IMAGE_VERSION) return false;
+    if (header->key != key || header->count != image->count) return false;
+    // The key is only a hash, the entry has to describe this exact code
+    for (uint64_t i = 0; i < image->count; i += 1) {
+        if (!prepared_valid(&image->instructions[i], image->code[i], image->count)) return false;
+    }
+    return true;
+}
+
+prepared_image_t* image_map(const instruction_t* code, uint64_t count, const char* path, uint64_t key) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    void* memory = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (uint64_t) st.st_size == image_size(count)) {
+        memory = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (memory == MAP_FAILED) return NULL;
+
+    prepared_image_t* image = image_of_memory(code, count, memory, true);
+    if (!image || !image_valid(image, key)) {
+        munmap(memory, image_size(count));
+        free(image);
+        return NULL;
+    }
+    return image;
+}
+
+// Written aside then renamed so that a concurrent process never maps a partial entry
+bool_t image_store(const prepared_image_t* image, const char* cache_dir, const char* path) {
+    if (mkdir(cache_dir, 0755) != 0 && errno != EEXIST) return false;
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long) getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    const uint8_t* bytes = image->memory;
+    uint64_t written = 0;
+    while (written < image->memory_size) {
+        ssize_t n = write(fd, bytes + written, image->memory_size - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += n;
+    }
+    close(fd);
+
+    if (written != image->memory_size || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+prepared_image_t* image_load(const instruction_t* code, uint64_t count, const char* cache_dir) {
+    if (!VM_BUILD_ID[0]) return image_prepare(code, count);
+    char path[4096];
+    uint64_t key = image_key(code, count);
+    image_path(path, sizeof(path), cache_dir, key);
+
+    prepared_image_t* image = image_map(code, count, path, key);
+    if (image) return image;
+
+    image = image_prepare(code, count);
+    // A cache that cannot be written only costs the next process a preparation
+    if (image) image_store(image, cache_dir, path);
+    return image;
+}
+
+void free_image(prepared_image_t* image) {
+    if (image->is_mapped) {
+        munmap(image->memory, image->memory_size);
+    } else {
+        free(image->memory);
+    }
+    free(image);
+}
@@ -0,0 +1,63 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include "divmagic.h"
+#include "util.h"
+#include "vm_base.h"
+
+#define VM_IMAGE_MAGIC 0x564D4950
+#define VM_IMAGE_VERSION 1
+
+// Hash of the sources that prepare instructions, set by the Makefile.
+// Without it the disk cache is bypassed, an entry could outlive the code that wrote it
+#ifndef VM_BUILD_ID
+#define VM_BUILD_ID ""
+#endif
+
+#define PREPARED_VALID 0x1
+#define PREPARED_REGISTER 0x2
+#define PREPARED_UNSIGNED 0x4
+#define PREPARED_LINK 0x8
+#define PREPARED_STORE 0x10
+
+// An instruction with its operands already decoded, [rhs] replaces [immediate]
+// when PREPARED_REGISTER is set. Pc relative branches hold their target index in [immediate]
+typedef struct {
+    instruction_t instruction;
+    uint8_t opcode;
+    uint8_t flags;
+    uint8_t dst;
+    uint8_t lhs;
+    uint8_t rhs;
+    uint8_t data_size;
+    uint16_t padding;
+    int64_t immediate;
+    div_magic_t magic;
+} prepared_instruction_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    // Hash of the code and of the vm build, also the name of the cache entry
+    uint64_t key;
+    uint64_t count;
+    uint64_t padding;
+} prepared_header_t;
+
+typedef struct {
+    const instruction_t* code;
+    uint64_t count;
+    const prepared_header_t* header;
+    const prepared_instruction_t* instructions;
+    void* memory;
+    uint64_t memory_size;
+    bool_t is_mapped;
+} prepared_image_t;
+
+prepared_image_t* image_prepare(const instruction_t* code, uint64_t count);
+// Maps the cache entry of [code] from [cache_dir], or prepares the code and stores the entry
+prepared_image_t* image_load(const instruction_t* code, uint64_t count, const char* cache_dir);
+void free_image(prepared_image_t* image);
+
+#endif
@@ -0,0 +1,399 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+#include "program.h"
+#include "vm.h"
+
+// Reorders the basic blocks of a program image from a profile written by vm_write_profile.
+// Hot successors are chained so that they fall through, blocks that never ran are moved
+// after every hot one and pc relative offsets are re-encoded. Instruction 0 stays the entry.
+//
+//     layout <image> <profile> <output image>
+
+#define PC_OFFSET_MASK 0x1FFFFFF
+#define PC_OFFSET_MAX ((int64_t) 0xFFFFFF)
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint64_t heat;
+    // Chain the block belongs to, and its neighbours inside the chain
+    uint64_t chain;
+    uint64_t next;
+    uint64_t previous;
+} block_t;
+
+typedef struct {
+    uint64_t from;
+    uint64_t to;
+    uint64_t count;
+} jump_edge_t;
+
+typedef struct {
+    uint64_t head;
+    uint64_t heat;
+} chain_t;
+
+#define NO_BLOCK UINT64_MAX
+
+#define bit(n) \
+    ((uint32_t) 1 << (n))
+
+bool_t is_branch(instruction_t instruction) {
+    return (instruction >> 27) == BR_JUMP;
+}
+
+bool_t is_jump(instruction_t instruction) {
+    return is_pc_branch(instruction) && !(instruction & bit(26));
+}
+
+// halt and ret never continue with the next instruction
+bool_t is_stop(instruction_t instruction) {
+    return (instruction >> 27) == HALT && ((instruction >> 25) & 0x3) <= 1;
+}
+
+int64_t pc_offset(instruction_t instruction) {
+    return sign_extend(instruction, 25);
+}
+
+// Register branches and pc relative lea compute addresses the layout cannot follow, and
+// code running off its end would continue in whatever block is placed after it
+const char* check_relocatable(const vm_program_t* program) {
+    instruction_t last = program->code[program->count - 1];
+    if (!is_jump(last) && !is_stop(last)) return "last instruction falling through";
+    for (uint64_t i = 0; i < program->count; i += 1) {
+        instruction_t instruction = program->code[i];
+        if (is_branch(instruction) && !is_pc_branch(instruction)) return "register branch";
+        if ((instruction >> 27) == LEA && !(instruction & bit(21))) return "pc relative lea";
+        if (is_pc_branch(instruction)) {
+            int64_t target = (int64_t) i + 1 + pc_offset(instruction);
+            if (target < 0 || (uint64_t) target >= program->count) return "branch out of the image";
+        }
+    }
+    return NULL;
+}
+
+uint8_t* read_file(const char* path, uint64_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    uint8_t* bytes = NULL;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long length = ftell(file);
+        if (length >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+            bytes = malloc(length ? length : 1);
+            if (bytes && fread(bytes, 1, length, file) != (size_t) length) {
+                free(bytes);
+                bytes = NULL;
+            }
+            *size = length;
+        }
+    }
+    fclose(file);
+    return bytes;
+}
+
+// Leaders are the entry, every branch target and every instruction following a branch or a stop
+uint64_t find_blocks(const vm_program_t* program, block_t** blocks, uint64_t** block_of) {
+    bool_t* leader = calloc(program->count + 1, sizeof(bool_t));
+    *block_of = malloc(program->count * sizeof(uint64_t));
+    if (!leader || !*block_of) {
+        free(leader);
+        return 0;
+    }
+
+    leader[0] = true;
+    for (uint64_t i = 0; i < program->count; i += 1) {
+        instruction_t instruction = program->code[i];
+        if (is_pc_branch(instruction)) leader[i + 1 + pc_offset(instruction)] = true;
+        if (is_branch(instruction) || is_stop(instruction)) leader[i + 1] = true;
+    }
+
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < program->count; i += 1) count += leader[i];
+    *blocks = calloc(count, sizeof(block_t));
+    if (!*blocks) {
+        free(leader);
+        return 0;
+    }
+
+    uint64_t block = 0;
+    for (uint64_t i = 0; i < program->count; i += 1) {
+        if (leader[i] && i) block += 1;
+        (*block_of)[i] = block;
+        (*blocks)[block].end = i + 1;
+        if (leader[i]) (*blocks)[block].start = i;
+    }
+    free(leader);
+    return count;
+}
+
+// The next block is reached without a jump: plain fall through, or the return point of a br
+bool_t falls_through(const vm_program_t* program, const block_t* block) {
+    instruction_t last = program->code[block->end - 1];
+    return !is_jump(last) && !is_stop(last);
+}
+
+// Blocks are visited in address order, so every heat flowing in from a lower block is known
+// before it is passed on. Backward edges only contribute their profiled count
+void propagate_heat(const vm_program_t* program, const vm_profile_t* profile, block_t* blocks, uint64_t count, const uint64_t* block_of) {
+    for (uint64_t i = 0; i < profile->capacity; i += 1) {
+        const profile_edge_t* edge = &profile->edges[i];
+        if (edge->count && edge->target < program->count && blocks[block_of[edge->target]].start == edge->target) {
+            blocks[block_of[edge->target]].heat += edge->count;
+        }
+    }
+    blocks[0].heat += 1;
+
+    for (uint64_t b = 0; b + 1 < count; b += 1) {
+        if (falls_through(program, &blocks[b]) && blocks[b].heat > blocks[b + 1].heat) {
+            blocks[b + 1].heat = blocks[b].heat;
+        }
+    }
+}
+
+void chain_append(block_t* blocks, uint64_t tail, uint64_t head) {
+    uint64_t chain = blocks[tail].chain;
+    blocks[tail].next = head;
+    blocks[head].previous = tail;
+    for (uint64_t b = head; b != NO_BLOCK; b = blocks[b].next) blocks[b].chain = chain;
+}
+
+int compare_edges(const void* lhs, const void* rhs) {
+    const jump_edge_t* a = lhs;
+    const jump_edge_t* b = rhs;
+    if (a->count != b->count) return a->count < b->count ? 1 : -1;
+    return a->from < b->from ? -1 : a->from > b->from;
+}
+
+int compare_chains(const void* lhs, const void* rhs) {
+    const chain_t* a = lhs;
+    const chain_t* b = rhs;
+    if (a->heat != b->heat) return a->heat < b->heat ? 1 : -1;
+    return a->head < b->head ? -1 : a->head > b->head;
+}
+
+// Pettis-Hansen: fall throughs are chained first, then jump edges from the hottest, each one
+// joining the tail of a chain to the head of another. A fall through between a block that ran
+// and one that never did is left unchained, emit turns it into a jump
+
+bool_t build_chains(const vm_program_t* program, const vm_profile_t* profile, block_t* blocks, uint64_t count, const uint64_t* block_of) {
+    for (uint64_t b = 0; b < count; b += 1) {
+        blocks[b].chain = b;
+        blocks[b].next = NO_BLOCK;
+        blocks[b].previous = NO_BLOCK;
+    }
+    for (uint64_t b = 0; b + 1 < count; b += 1) {
+        bool_t same_region = (blocks[b].heat == 0) == (blocks[b + 1].heat == 0);
+        if (falls_through(program, &blocks[b]) && same_region) chain_append(blocks, b, b + 1);
+    }
+
+    jump_edge_t* edges = malloc(count * sizeof(jump_edge_t));
+    if (!edges) return false;
+    uint64_t edges_count = 0;
+    for (uint64_t b = 0; b < count; b += 1) {
+        uint64_t site = blocks[b].end - 1;
+        instruction_t last = program->code[site];
+        if (!is_jump(last)) continue;
+        uint64_t target = site + 1 + pc_offset(last);
+        uint64_t taken = profile_count(profile, site, target);
+        if (!taken) continue;
+        edges[edges_count++] = (jump_edge_t) {.from = b, .to = block_of[target], .count = taken};
+    }
+    qsort(edges, edges_count, sizeof(jump_edge_t), compare_edges);
+
+    for (uint64_t i = 0; i < edges_count; i += 1) {
+        uint64_t from = edges[i].from;
+        uint64_t to = edges[i].to;
+        // The entry has to stay the head of the first chain
+        if (to == 0) continue;
+        if (blocks[from].next != NO_BLOCK || blocks[to].previous != NO_BLOCK) continue;
+        if (blocks[from].chain == blocks[to].chain) continue;
+        chain_append(blocks, from, to);
+    }
+    free(edges);
+    return true;
+}
+
+// Entry chain first, then hot chains by heat, then the cold region in address order
+uint64_t* order_blocks(const block_t* blocks, uint64_t count) {
+    chain_t* chains = malloc(count * sizeof(chain_t));
+    uint64_t* order = malloc(count * sizeof(uint64_t));
+    if (!chains || !order) {
+        free(chains);
+        free(order);
+        return NULL;
+    }
+
+    uint64_t chains_count = 0;
+    for (uint64_t b = 1; b < count; b += 1) {
+        if (blocks[b].previous != NO_BLOCK) continue;
+        uint64_t heat = 0;
+        for (uint64_t c = b; c != NO_BLOCK; c = blocks[c].next) {
+            if (blocks[c].heat > heat) heat = blocks[c].heat;
+        }
+        chains[chains_count++] = (chain_t) {.head = b, .heat = heat};
+    }
+    qsort(chains, chains_count, sizeof(chain_t), compare_chains);
+
+    uint64_t index = 0;
+    for (uint64_t c = 0; c != NO_BLOCK; c = blocks[c].next) order[index++] = c;
+    for (uint64_t i = 0; i < chains_count; i += 1) {
+        for (uint64_t c = chains[i].head; c != NO_BLOCK; c = blocks[c].next) order[index++] = c;
+    }
+    free(chains);
+    return order;
+}
+
+#define NO_TARGET UINT64_MAX
+
+// Lays the blocks out, drops jumps to the next block, adds one where a fall through was split
+// and re-encodes every pc relative offset
+vm_program_t* emit(const vm_program_t* program, const block_t* blocks, uint64_t count, const uint64_t* order, uint64_t* removed, uint64_t* added) {
+    uint64_t capacity = program->count + count;
+    uint64_t* new_index = malloc(program->count * sizeof(uint64_t));
+    // Original index of the target of each emitted pc relative branch
+    uint64_t* targets = malloc(capacity * sizeof(uint64_t));
+    vm_program_t* out = calloc(1, sizeof(vm_program_t));
+    instruction_t* code = malloc(capacity * sizeof(instruction_t));
+    if (!new_index || !targets || !out || !code) {
+        free(new_index);
+        free(targets);
+        free(out);
+        free(code);
+        return NULL;
+    }
+    out->code = code;
+
+    *removed = 0;
+    *added = 0;
+    uint64_t position = 0;
+    for (uint64_t i = 0; i < count; i += 1) {
+        const block_t* block = &blocks[order[i]];
+        uint64_t next = i + 1 < count ? blocks[order[i + 1]].start : NO_TARGET;
+        for (uint64_t ip = block->start; ip < block->end; ip += 1) {
+            instruction_t instruction = program->code[ip];
+            new_index[ip] = position;
+            uint64_t target = is_pc_branch(instruction) ? ip + 1 + pc_offset(instruction) : NO_TARGET;
+            // A branch to a removed jump lands on its target, which is the next instruction
+            if (ip + 1 == block->end && is_jump(instruction) && target == next) {
+                *removed += 1;
+                continue;
+            }
+            targets[position] = target;
+            code[position++] = instruction;
+        }
+        if (falls_through(program, block) && block->end != next) {
+            *added += 1;
+            targets[position] = block->end;
+            code[position++] = (instruction_t) BR_JUMP << 27;
+        }
+    }
+    out->count = position;
+
+    bool_t valid = true;
+    for (position = 0; position < out->count; position += 1) {
+        if (targets[position] == NO_TARGET) continue;
+        int64_t offset = (int64_t) new_index[targets[position]] - (int64_t) (position + 1);
+        if (offset > PC_OFFSET_MAX || offset < -PC_OFFSET_MAX - 1) valid = false;
+        code[position] = (code[position] & ~PC_OFFSET_MASK) | (offset & PC_OFFSET_MASK);
+    }
+    free(new_index);
+    free(targets);
+    if (!valid) {
+        free_program(out);
+        return NULL;
+    }
+    return out;
+}
+
+bool_t write_program(const char* path, const vm_program_t* program) {
+    FILE* file = fopen(path, "wb");
+    if (!file) return false;
+    vm_program_header_t header = {
+        .magic = VM_PROGRAM_MAGIC,
+        .version = VM_PROGRAM_VERSION,
+        .flags = 0,
+        .size = program->count * sizeof(instruction_t),
+    };
+    bool_t written = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(program->code, sizeof(instruction_t), program->count, file) == program->count;
+    return fclose(file) == 0 && written;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <image> <profile> <output image>\n", argv[0]);
+        return 2;
+    }
+
+    uint64_t size = 0;
+    uint8_t* bytes = read_file(argv[1], &size);
+    const vm_program_header_t* header = (const vm_program_header_t*) bytes;
+    if (!bytes || size < sizeof(vm_program_header_t) || header->size != size - sizeof(vm_program_header_t)) {
+        fprintf(stderr, "%s: cannot read the image\n", argv[1]);
+        free(bytes);
+        return 1;
+    }
+    // A compressed image is expanded, the profile counts instructions of the expanded code
+    vm_program_t* program = program_load(header);
+    free(bytes);
+    if (!program || program->count == 0) {
+        fprintf(stderr, "%s: malformed image\n", argv[1]);
+        if (program) free_program(program);
+        return 1;
+    }
+
+    const char* reason = check_relocatable(program);
+    if (reason) {
+        fprintf(stderr, "%s: cannot relayout an image with a %s\n", argv[1], reason);
+        free_program(program);
+        return 1;
+    }
+
+    vm_profile_t* profile = profile_read(argv[2]);
+    if (!profile) {
+        fprintf(stderr, "%s: cannot read the profile\n", argv[2]);
+        free_program(program);
+        return 1;
+    }
+
+    int status = 1;
+    block_t* blocks = NULL;
+    uint64_t* block_of = NULL;
+    uint64_t* order = NULL;
+    vm_program_t* out = NULL;
+    uint64_t removed = 0;
+    uint64_t added = 0;
+    uint64_t count = find_blocks(program, &blocks, &block_of);
+    if (count) {
+        propagate_heat(program, profile, blocks, count, block_of);
+        if (build_chains(program, profile, blocks, count, block_of)) order = order_blocks(blocks, count);
+        if (order) out = emit(program, blocks, count, order, &removed, &added);
+    }
+
+    if (!out) {
+        fprintf(stderr, "layout failed\n");
+    } else if (!write_program(argv[3], out)) {
+        fprintf(stderr, "%s: cannot write the image\n", argv[3]);
+    } else {
+        uint64_t cold = 0;
+        for (uint64_t b = 0; b < count; b += 1) cold += blocks[b].heat == 0;
+        fprintf(stderr, "%llu blocks, %llu cold, %llu jumps removed, %llu added, %llu -> %llu instructions\n",
+            (unsigned long long) count, (unsigned long long) cold, (unsigned long long) removed, (unsigned long long) added,
+            (unsigned long long) program->count, (unsigned long long) out->count
+        );
+        status = 0;
+    }
+
+    if (out) free_program(out);
+    free(order);
+    free(blocks);
+    free(block_of);
+    free_profile(profile);
+    free_program(program);
+    return status;
+}
@@ -9,8 +9,10 @@ const instruction_t code [] = {
 };
 
 int main() {
-    vm_t* vm = vm_init(code, 16, 0);
-    int status = vm_run(vm);
+    vm_t* vm = vm_init(code, sizeof(code) / sizeof(code[0]), 16, 0);
+    if (!vm) return 1;
+    vm_return_t result = vm_run(vm);
+    if (result.status) fprintf(stderr, "%s (opcode %u)\n", result.reason.message, result.reason.op);
     free_vm(vm);
-    return status;
+    return result.status;
 }
\ No newline at end of file
@@ -0,0 +1,66 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mapping.h"
+
+bool_t mapping_overlap(const vm_mapping_t* mapping, reg_t guest_address, uint64_t size) {
+    return guest_address < mapping->guest_address + mapping->size
+        && mapping->guest_address < guest_address + size;
+}
+
+bool_t mapping_add(vm_address_space_t* space, void* host, uint64_t size, reg_t guest_address, vm_prot_t prot) {
+    if (!host || size == 0 || space->count == VM_MAX_MAPPINGS) return false;
+    if (guest_address + size < guest_address) return false;
+    for (uint32_t i = 0; i < space->count; i += 1) {
+        if (mapping_overlap(&space->entries[i], guest_address, size)) return false;
+    }
+
+    vm_mapping_t mapping = {.guest_address = guest_address, .size = size, .host = host, .prot = prot};
+    space->entries[space->count++] = mapping;
+    return true;
+}
+
+bool_t mapping_remove(vm_address_space_t* space, reg_t guest_address) {
+    for (uint32_t i = 0; i < space->count; i += 1) {
+        if (space->entries[i].guest_address == guest_address) {
+            space->count -= 1;
+            space->entries[i] = space->entries[space->count];
+            space->last = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+void mapping_clear(vm_address_space_t* space) {
+    memset(space, 0, sizeof(vm_address_space_t));
+}
+
+translation_kind_t translate_in(const vm_mapping_t* mapping, reg_t address, uint64_t size, vm_prot_t access, uint8_t** host) {
+    uint64_t offset = address - mapping->guest_address;
+    if (size > mapping->size - offset) return FAULT;
+    if ((mapping->prot & access) != access) return FAULT;
+    *host = mapping->host + offset;
+    return MAPPED;
+}
+
+translation_kind_t mapping_translate(vm_address_space_t* space, reg_t address, uint64_t size, vm_prot_t access, uint8_t** host) {
+    if (space->count == 0) return UNMAPPED;
+
+    const vm_mapping_t* last = &space->entries[space->last];
+    if (address - last->guest_address < last->size) {
+        return translate_in(last, address, size, access, host);
+    }
+
+    for (uint32_t i = 0; i < space->count; i += 1) {
+        const vm_mapping_t* mapping = &space->entries[i];
+        if (address - mapping->guest_address < mapping->size) {
+            space->last = i;
+            return translate_in(mapping, address, size, access, host);
+        }
+        // An access starting below a mapping and ending inside it is not wholly mapped
+        if (mapping->guest_address - address < size) return FAULT;
+    }
+    return UNMAPPED;
+}
@@ -0,0 +1,42 @@
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include <stdint.h>
+#include "util.h"
+#include "vm_base.h"
+
+#define VM_MAX_MAPPINGS 16
+
+typedef enum {
+    VM_PROT_READ = 1,
+    VM_PROT_WRITE = 2,
+    VM_PROT_RW = VM_PROT_READ | VM_PROT_WRITE
+} vm_prot_t;
+
+typedef enum {
+    UNMAPPED,
+    MAPPED,
+    FAULT
+} translation_kind_t;
+
+// Caller owned host memory seen by the guest at [guest_address, guest_address + size)
+typedef struct {
+    reg_t guest_address;
+    uint64_t size;
+    uint8_t* host;
+    vm_prot_t prot;
+} vm_mapping_t;
+
+typedef struct {
+    vm_mapping_t entries[VM_MAX_MAPPINGS];
+    uint32_t count;
+    // Index of the last mapping hit, loads and stores tend to stay in the same buffer
+    uint32_t last;
+} vm_address_space_t;
+
+bool_t mapping_add(vm_address_space_t* space, void* host, uint64_t size, reg_t guest_address, vm_prot_t prot);
+bool_t mapping_remove(vm_address_space_t* space, reg_t guest_address);
+void mapping_clear(vm_address_space_t* space);
+translation_kind_t mapping_translate(vm_address_space_t* space, reg_t address, uint64_t size, vm_prot_t access, uint8_t** host);
+
+#endif
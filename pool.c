@@ -0,0 +1,57 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pool.h"
+#include "vm.h"
+
+vm_pool_t* vm_pool_create(uint32_t size, uint64_t stack_size) {
+    vm_pool_t* pool = malloc(sizeof(vm_pool_t));
+    if (!pool) return NULL;
+    pool->vms = calloc(size, sizeof(vm_t*));
+    pool->size = 0;
+    pool->available = 0;
+    if (!pool->vms) {
+        free(pool);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < size; i += 1) {
+        vm_t* vm = vm_init(NULL, 0, stack_size, 0);
+        if (!vm) {
+            free_vm_pool(pool);
+            return NULL;
+        }
+        pool->vms[pool->size++] = vm;
+        pool->available = pool->size;
+    }
+    return pool;
+}
+
+vm_t* vm_acquire(vm_pool_t* pool, instruction_t const * const code, uint64_t count, uint64_t offset) {
+    if (pool->available == 0) return NULL;
+    vm_t* vm = pool->vms[--pool->available];
+    vm_load(vm, code, count, offset);
+    return vm;
+}
+
+int vm_release(vm_pool_t* pool, vm_t* vm) {
+    // A double release or a vm of another pool is not among the acquired ones
+    uint32_t index = pool->available;
+    while (index < pool->size && pool->vms[index] != vm) index += 1;
+    if (index == pool->size) return -1;
+
+    // Reset on release so that the host buffers mapped by the request are dropped right away
+    vm_reset(vm);
+    pool->vms[index] = pool->vms[pool->available];
+    pool->vms[pool->available++] = vm;
+    return 0;
+}
+
+void free_vm_pool(vm_pool_t* pool) {
+    for (uint32_t i = 0; i < pool->size; i += 1) {
+        free_vm(pool->vms[i]);
+    }
+    free(pool->vms);
+    free(pool);
+}
@@ -0,0 +1,22 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include "vm.h"
+
+// Preallocated vms handed out per request, a pool is not thread safe: one pool per thread
+typedef struct {
+    vm_t** vms;
+    uint32_t size;
+    // vms[0 .. available) are free, vms[available .. size) are acquired
+    uint32_t available;
+} vm_pool_t;
+
+vm_pool_t* vm_pool_create(uint32_t size, uint64_t stack_size);
+vm_t* vm_acquire(vm_pool_t* pool, instruction_t const * const code, uint64_t count, uint64_t offset);
+// Resets the vm: its mappings and channels are dropped. -1 when [vm] is not acquired from [pool]
+int vm_release(vm_pool_t* pool, vm_t* vm);
+// Frees every vm of the pool, acquired ones included
+void free_vm_pool(vm_pool_t* pool);
+
+#endif
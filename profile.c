@@ -0,0 +1,100 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "profile.h"
+
+uint64_t edge_hash(uint64_t site, uint64_t target) {
+    return (site * 0x9E3779B97F4A7C15ULL) ^ (target * 0xC2B2AE3D27D4EB4FULL);
+}
+
+profile_edge_t* edge_slot(profile_edge_t* edges, uint64_t capacity, uint64_t site, uint64_t target) {
+    uint64_t index = edge_hash(site, target) & (capacity - 1);
+    while (edges[index].count && (edges[index].site != site || edges[index].target != target)) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return &edges[index];
+}
+
+vm_profile_t* profile_create() {
+    vm_profile_t* profile = malloc(sizeof(vm_profile_t));
+    if (!profile) return NULL;
+    profile->capacity = 256;
+    profile->count = 0;
+    profile->edges = calloc(profile->capacity, sizeof(profile_edge_t));
+    if (!profile->edges) {
+        free(profile);
+        return NULL;
+    }
+    return profile;
+}
+
+bool_t profile_grow(vm_profile_t* profile) {
+    uint64_t capacity = profile->capacity * 2;
+    profile_edge_t* edges = calloc(capacity, sizeof(profile_edge_t));
+    if (!edges) return false;
+    for (uint64_t i = 0; i < profile->capacity; i += 1) {
+        const profile_edge_t* edge = &profile->edges[i];
+        if (edge->count) *edge_slot(edges, capacity, edge->site, edge->target) = *edge;
+    }
+    free(profile->edges);
+    profile->edges = edges;
+    profile->capacity = capacity;
+    return true;
+}
+
+void profile_record(vm_profile_t* profile, uint64_t site, uint64_t target, uint64_t count) {
+    profile_edge_t* edge = edge_slot(profile->edges, profile->capacity, site, target);
+    if (!edge->count) {
+        // A profile that cannot grow keeps the edges it already has
+        if ((profile->count + 1) * 2 > profile->capacity) {
+            if (!profile_grow(profile)) return;
+            edge = edge_slot(profile->edges, profile->capacity, site, target);
+        }
+        edge->site = site;
+        edge->target = target;
+        profile->count += 1;
+    }
+    edge->count += count;
+}
+
+uint64_t profile_count(const vm_profile_t* profile, uint64_t site, uint64_t target) {
+    return edge_slot(profile->edges, profile->capacity, site, target)->count;
+}
+
+bool_t profile_write(const vm_profile_t* profile, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+    for (uint64_t i = 0; i < profile->capacity; i += 1) {
+        const profile_edge_t* edge = &profile->edges[i];
+        if (edge->count) {
+            fprintf(file, "%llu %llu %llu\n",
+                (unsigned long long) edge->site, (unsigned long long) edge->target, (unsigned long long) edge->count
+            );
+        }
+    }
+    return fclose(file) == 0;
+}
+
+vm_profile_t* profile_read(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) return NULL;
+    vm_profile_t* profile = profile_create();
+    if (!profile) {
+        fclose(file);
+        return NULL;
+    }
+
+    unsigned long long site, target, count;
+    while (fscanf(file, "%llu %llu %llu", &site, &target, &count) == 3) {
+        if (count) profile_record(profile, site, target, count);
+    }
+    fclose(file);
+    return profile;
+}
+
+void free_profile(vm_profile_t* profile) {
+    free(profile->edges);
+    free(profile);
+}
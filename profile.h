@@ -0,0 +1,28 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include "util.h"
+
+// Taken count of a branch, [site] and [target] are instruction indexes
+typedef struct {
+    uint64_t site;
+    uint64_t target;
+    uint64_t count;
+} profile_edge_t;
+
+typedef struct {
+    profile_edge_t* edges;
+    uint64_t capacity;
+    uint64_t count;
+} vm_profile_t;
+
+vm_profile_t* profile_create();
+void profile_record(vm_profile_t* profile, uint64_t site, uint64_t target, uint64_t count);
+uint64_t profile_count(const vm_profile_t* profile, uint64_t site, uint64_t target);
+// One "site target count" line per edge, edges appearing several times are summed on read
+bool_t profile_write(const vm_profile_t* profile, const char* path);
+vm_profile_t* profile_read(const char* path);
+void free_profile(vm_profile_t* profile);
+
+#endif
@@ -0,0 +1,162 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "program.h"
+#include "vm.h"
+
+#define COMPRESSED_MARK 0x7
+#define PC_OFFSET_MASK 0x1FFFFFF
+
+typedef enum {
+    C_MV,
+    C_LI,
+    C_ADDI,
+    C_ADD,
+    C_SUB,
+    C_SYS,
+    C_JUMP,
+    C_BR
+} compressed_opcode_t;
+
+#define bit(n) \
+    ((uint32_t) 1 << (n))
+
+#define is_compressed(parcel) \
+    (((parcel) >> 13) == COMPRESSED_MARK)
+
+int64_t sign_extend(uint64_t value, uint32_t bits) {
+    uint64_t sign = (uint64_t) 1 << (bits - 1);
+    value &= (sign << 1) - 1;
+    return (int64_t) ((value ^ sign) - sign);
+}
+
+bool_t is_pc_branch(instruction_t instruction) {
+    return (instruction >> 27) == BR_JUMP && !(instruction & bit(25));
+}
+
+// Offset in parcels of the pc relative branch starting at [parcel], false when there is none
+bool_t parcel_offset(const uint16_t* parcels, uint64_t parcel, int64_t* offset) {
+    uint16_t first = parcels[parcel];
+    if (is_compressed(first)) {
+        compressed_opcode_t op = (first >> 10) & 0x7;
+        if (op != C_JUMP && op != C_BR) return false;
+        *offset = sign_extend(first, 10);
+        return true;
+    }
+
+    instruction_t instruction = ((instruction_t) first << 16) | parcels[parcel + 1];
+    if (!is_pc_branch(instruction)) return false;
+    *offset = sign_extend(instruction, 25);
+    return true;
+}
+
+instruction_t expand(uint16_t parcel) {
+    uint32_t rd = (parcel >> 7) & 0x7;
+    uint32_t rs = (parcel >> 4) & 0x7;
+    int64_t litteral = sign_extend(parcel, 7);
+    switch ((compressed_opcode_t) ((parcel >> 10) & 0x7)) {
+    case C_MV:
+        return ((instruction_t) MOV << 27) | (rd << 22) | bit(21) | (rs << 16);
+    case C_LI:
+        return ((instruction_t) MOV << 27) | (rd << 22) | (litteral & 0x1FFFFF);
+    case C_ADDI:
+        return ((instruction_t) ADD << 27) | (rd << 22) | (rd << 17) | (litteral & 0xFFFF);
+    case C_ADD:
+        return ((instruction_t) ADD << 27) | (rd << 22) | (rd << 17) | bit(16) | (rs << 11);
+    case C_SUB:
+        return ((instruction_t) SUB << 27) | (rd << 22) | (rd << 17) | bit(16) | (rs << 11);
+    case C_SYS:
+        // rd: 0 halt, 1 ret, 2 syscall
+        return ((instruction_t) HALT << 27) | ((rd & 0x3) << 25);
+    case C_JUMP:
+        return (instruction_t) BR_JUMP << 27;
+    case C_BR:
+        return ((instruction_t) BR_JUMP << 27) | bit(26);
+    }
+    return 0;
+}
+
+vm_program_t* program_alloc(uint64_t count, uint64_t parcel_count) {
+    vm_program_t* program = calloc(1, sizeof(vm_program_t));
+    if (!program) return NULL;
+    program->count = count;
+    program->parcel_count = parcel_count;
+    program->code = malloc(count ? count * sizeof(instruction_t) : sizeof(instruction_t));
+    program->parcel_map = parcel_count ? malloc(parcel_count * sizeof(uint64_t)) : NULL;
+    if (!program->code || (parcel_count && !program->parcel_map)) {
+        free_program(program);
+        return NULL;
+    }
+    return program;
+}
+
+vm_program_t* program_expand(const uint16_t* parcels, uint64_t parcel_count) {
+    uint64_t count = 0;
+    for (uint64_t parcel = 0; parcel < parcel_count; count += 1) {
+        parcel += is_compressed(parcels[parcel]) ? 1 : 2;
+    }
+
+    vm_program_t* program = program_alloc(count, parcel_count);
+    if (!program) return NULL;
+
+    uint64_t index = 0;
+    for (uint64_t parcel = 0; parcel < parcel_count; index += 1) {
+        bool_t compressed = is_compressed(parcels[parcel]);
+        if (!compressed && parcel + 1 >= parcel_count) {
+            free_program(program);
+            return NULL;
+        }
+        program->parcel_map[parcel] = index;
+        if (!compressed) program->parcel_map[parcel + 1] = UINT64_MAX;
+        parcel += compressed ? 1 : 2;
+    }
+
+    index = 0;
+    for (uint64_t parcel = 0; parcel < parcel_count; index += 1) {
+        bool_t compressed = is_compressed(parcels[parcel]);
+        uint64_t next = parcel + (compressed ? 1 : 2);
+        instruction_t instruction = compressed
+            ? expand(parcels[parcel])
+            : ((instruction_t) parcels[parcel] << 16) | parcels[parcel + 1];
+
+        // Pc relative offsets count parcels, they are rewritten to count instructions
+        int64_t offset;
+        if (parcel_offset(parcels, parcel, &offset)) {
+            int64_t target = (int64_t) next + offset;
+            if (target < 0 || (uint64_t) target >= parcel_count || program->parcel_map[target] == UINT64_MAX) {
+                free_program(program);
+                return NULL;
+            }
+            int64_t rewritten = (int64_t) program->parcel_map[target] - (int64_t) (index + 1);
+            instruction = (instruction & ~PC_OFFSET_MASK) | (rewritten & PC_OFFSET_MASK);
+        }
+
+        program->code[index] = instruction;
+        parcel = next;
+    }
+    return program;
+}
+
+vm_program_t* program_load(const vm_program_header_t* header) {
+    if (header->magic != VM_PROGRAM_MAGIC || header->version != VM_PROGRAM_VERSION) return NULL;
+    const uint8_t* bytes = (const uint8_t*) (header + 1);
+
+    if (header->flags & VM_PROGRAM_COMPRESSED) {
+        if (header->size % sizeof(uint16_t) != 0) return NULL;
+        return program_expand((const uint16_t*) bytes, header->size / sizeof(uint16_t));
+    }
+
+    if (header->size % sizeof(instruction_t) != 0) return NULL;
+    vm_program_t* program = program_alloc(header->size / sizeof(instruction_t), 0);
+    if (!program) return NULL;
+    memcpy(program->code, bytes, header->size);
+    return program;
+}
+
+void free_program(vm_program_t* program) {
+    free(program->code);
+    free(program->parcel_map);
+    free(program);
+}
@@ -0,0 +1,40 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include <stdint.h>
+#include "util.h"
+#include "vm_base.h"
+
+#define VM_PROGRAM_MAGIC 0x564D5052
+#define VM_PROGRAM_VERSION 1
+
+// The code is a stream of 16 bits parcels mixing compressed and regular instructions.
+// Compression only shrinks the stored image: program_load expands it to regular
+// instructions, the VM never fetches parcels
+#define VM_PROGRAM_COMPRESSED 0x1
+
+// Header of a program image, followed by [size] bytes of code
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint64_t size;
+} vm_program_header_t;
+
+typedef struct {
+    instruction_t* code;
+    uint64_t count;
+    // Instruction index of each parcel of a compressed stream, UINT64_MAX for a parcel
+    // inside an instruction. NULL when the image was not compressed
+    uint64_t* parcel_map;
+    uint64_t parcel_count;
+} vm_program_t;
+
+// Expands the code following [header] to regular instructions, NULL if the image is malformed
+vm_program_t* program_load(const vm_program_header_t* header);
+void free_program(vm_program_t* program);
+int64_t sign_extend(uint64_t value, uint32_t bits);
+// br or jump with a pc relative offset
+bool_t is_pc_branch(instruction_t instruction);
+
+#endif
@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "stack.h"
 #include "util.h"
@@ -15,20 +17,30 @@
 
 vm_stack_t* stack_create(uint64_t size) {
     vm_stack_t* stack_ptr = malloc(sizeof(vm_stack_t));
-    if (!stack_ptr) failwith("Stack alloc failed", 1);
+    if (!stack_ptr) return NULL;
 
     uint64_t alligned_size = align8(size);
-    uint64_t alloc_size = alligned_size * sizeof(uint64_t);
+    uint64_t alloc_size = alignn(alligned_size * sizeof(uint64_t), sysconf(_SC_PAGESIZE));
 
-    uint8_t* memory = malloc(alloc_size);
-    if (!memory) failwith("Malloc failed", 1);
-    vm_stack_t stack = {.memory = memory, .size = alligned_size, .sp = 0};
+    // Own mapping so that the dirty pages can be dropped on reset
+    uint8_t* memory = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (memory == MAP_FAILED) {
+        free(stack_ptr);
+        return NULL;
+    }
+    vm_stack_t stack = {.memory = memory, .size = alligned_size, .mapped_size = alloc_size, .sp = 0};
     memcpy(stack_ptr, &stack, sizeof(vm_stack_t));
     return stack_ptr;
 }
 
+void stack_reset(vm_stack_t* stack) {
+    // The next touch of a page gets a zero page, the cost is the pages touched since the last reset
+    madvise(stack->memory, stack->mapped_size, MADV_DONTNEED);
+    stack->sp = 0;
+}
+
 void free_stack(vm_stack_t* stack) {
-    free(stack->memory);
+    munmap(stack->memory, stack->mapped_size);
     free(stack);
 }
 
@@ -46,15 +58,16 @@ bool_t push(vm_stack_t* stack, uint64_t value){
     return true;
 }
 
-uint64_t pop(vm_stack_t* stack){
-    if (stack->sp == 0) failwith("Empty stack", 1);
-    return stack->memory[stack->sp--];
+bool_t pop(vm_stack_t* stack, uint64_t* value){
+    if (stack->sp == 0) return false;
+    *value = stack->memory[stack->sp--];
+    return true;
 }
 
-void set_n(vm_stack_t* stack, uint64_t value, uint64_t index) {
-    if (index >= stack->sp || index <= 0 ) failwith("Wrong index stack set", 1);
+bool_t set_n(vm_stack_t* stack, uint64_t value, uint64_t index) {
+    if (index >= stack->sp || index <= 0 ) return false;
     stack->memory[index] = value;
-    return;
+    return true;
 }
 
 bool_t alloc_n(vm_stack_t* stack, uint64_t size) {
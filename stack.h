@@ -8,13 +8,15 @@
 typedef struct {
     uint8_t* const memory;
     const uint64_t size;
+    const uint64_t mapped_size;
     reg_t sp;
 } vm_stack_t;
 
 vm_stack_t* stack_create(uint64_t size);
+void stack_reset(vm_stack_t* stack);
 void free_stack(vm_stack_t* stack);
 bool_t is_empty(vm_stack_t* stack);
 bool_t push(vm_stack_t* stack, uint64_t value);
-uint64_t pop(vm_stack_t* stack);
+bool_t pop(vm_stack_t* stack, uint64_t* value);
 
 #endif
\ No newline at end of file
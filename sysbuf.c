@@ -0,0 +1,156 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "sysbuf.h"
+
+vm_sysbuf_t* sysbuf_create() {
+    vm_sysbuf_t* buffer = calloc(1, sizeof(vm_sysbuf_t));
+    if (!buffer) return NULL;
+    buffer->fd = -1;
+    buffer->error_fd = -1;
+    return buffer;
+}
+
+#define SYSBUF_FD_WRITABLE 0x1
+#define SYSBUF_FD_TTY_CHECKED 0x2
+#define SYSBUF_FD_TTY 0x4
+
+// Fds above the cache get a throwaway entry, they are checked again on every switch to them
+uint8_t* fd_state(vm_sysbuf_t* buffer, int fd, uint8_t* scratch) {
+    if (fd >= 0 && fd < SYSBUF_FD_CACHE) return &buffer->fds[fd];
+    *scratch = 0;
+    return scratch;
+}
+
+// Only fds that take a whole write or fail are buffered: a non blocking fd or a socket can
+// accept part of a write, which the guest has to see. Only a success is cached: the guest
+// may open the fd or clear O_NONBLOCK afterwards
+bool_t is_bufferable(vm_sysbuf_t* buffer, int fd) {
+    uint8_t scratch;
+    uint8_t* state = fd_state(buffer, fd, &scratch);
+    if (!(*state & SYSBUF_FD_WRITABLE)) {
+        buffer->host_syscalls += 2;
+        int flags = fcntl(fd, F_GETFL);
+        struct stat info;
+        if (flags >= 0 && (flags & O_ACCMODE) != O_RDONLY && !(flags & O_NONBLOCK) && !fstat(fd, &info) &&
+            !S_ISSOCK(info.st_mode)) {
+            *state |= SYSBUF_FD_WRITABLE;
+        }
+    }
+    return *state & SYSBUF_FD_WRITABLE;
+}
+
+bool_t is_tty(vm_sysbuf_t* buffer, int fd) {
+    uint8_t scratch;
+    uint8_t* state = fd_state(buffer, fd, &scratch);
+    if (!(*state & SYSBUF_FD_TTY_CHECKED)) {
+        buffer->host_syscalls += 1;
+        *state |= SYSBUF_FD_TTY_CHECKED | (isatty(fd) ? SYSBUF_FD_TTY : 0);
+    }
+    return *state & SYSBUF_FD_TTY;
+}
+
+// Writes the buffer then [data] with as few writev as the kernel allows. Bytes of [data]
+// written, or -1 with errno set when the kernel failed before reaching any of them. Buffered
+// bytes the kernel refused stay in the buffer for the next flush
+int64_t flush_with(vm_sysbuf_t* buffer, const uint8_t* data, uint64_t size) {
+    uint64_t buffered = 0;
+    uint64_t sent = 0;
+    while (buffered < buffer->size || sent < size) {
+        struct iovec iov[2] = {
+            {.iov_base = buffer->data + buffered, .iov_len = buffer->size - buffered},
+            {.iov_base = (uint8_t*) data + sent, .iov_len = size - sent},
+        };
+        int skip = buffered == buffer->size;
+        buffer->host_syscalls += 1;
+        ssize_t written = writev(buffer->fd, iov + skip, 2 - skip);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+            if (written == 0) errno = EIO;
+            break;
+        }
+        // Short writes are retried from where the kernel stopped
+        uint64_t from_buffer = buffer->size - buffered;
+        if ((uint64_t) written < from_buffer) from_buffer = written;
+        buffered += from_buffer;
+        sent += written - from_buffer;
+    }
+
+    bool_t complete = buffered == buffer->size && sent == size;
+    memmove(buffer->data, buffer->data + buffered, buffer->size - buffered);
+    buffer->size -= buffered;
+    if (!buffer->size) buffer->fd = -1;
+    return complete || sent ? (int64_t) sent : -1;
+}
+
+void sysbuf_flush(vm_sysbuf_t* buffer) {
+    if (!buffer->size) return;
+    int fd = buffer->fd;
+    if (flush_with(buffer, NULL, 0) < 0 && buffer->error_fd < 0) {
+        buffer->error_fd = fd;
+        buffer->error = errno;
+    }
+}
+
+int64_t sysbuf_write(vm_sysbuf_t* buffer, int fd, const uint8_t* data, uint64_t size) {
+    buffer->guest_syscalls += 1;
+    // Only one fd is buffered so writes to different fds keep their order
+    if (buffer->size && buffer->fd != fd) sysbuf_flush(buffer);
+    if (fd == buffer->error_fd) {
+        buffer->error_fd = -1;
+        errno = buffer->error;
+        return -1;
+    }
+    // The kernel decides what an empty write or a write to an fd that cannot take it returns,
+    // another fd whose bytes could not be flushed keeps the buffer
+    if (size == 0 || (buffer->size && buffer->fd != fd) || (fd != buffer->fd && !is_bufferable(buffer, fd))) {
+        buffer->host_syscalls += 1;
+        return write(fd, data, size);
+    }
+
+    buffer->fd = fd;
+    if (buffer->size + size > SYSBUF_SIZE) return flush_with(buffer, data, size);
+
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    // Line buffered like stdio when someone is watching
+    if (memchr(data, '\n', size) && is_tty(buffer, fd)) sysbuf_flush(buffer);
+    return size;
+}
+
+bool_t sysbuf_take_error(vm_sysbuf_t* buffer) {
+    if (buffer->error_fd < 0) return false;
+    buffer->error_fd = -1;
+    return true;
+}
+
+void sysbuf_forget(vm_sysbuf_t* buffer, int fd) {
+    if (fd >= 0 && fd < SYSBUF_FD_CACHE) buffer->fds[fd] = 0;
+    // Bytes left by a failed flush must not reach whatever reuses the fd, the error was recorded
+    if (buffer->fd == fd) {
+        buffer->size = 0;
+        buffer->fd = -1;
+    }
+}
+
+void sysbuf_reset(vm_sysbuf_t* buffer) {
+    // Whatever a failed flush left was reported when the guest halted
+    buffer->size = 0;
+    buffer->fd = -1;
+    buffer->guest_syscalls = 0;
+    buffer->host_syscalls = 0;
+    buffer->error_fd = -1;
+    memset(buffer->fds, 0, sizeof(buffer->fds));
+}
+
+void free_sysbuf(vm_sysbuf_t* buffer) {
+    sysbuf_flush(buffer);
+    free(buffer);
+}
@@ -0,0 +1,38 @@
+#ifndef SYSBUF_H
+#define SYSBUF_H
+
+#include <stdint.h>
+#include "util.h"
+
+#define SYSBUF_SIZE 4096
+// fcntl, fstat and isatty results are cached for the fds below this bound
+#define SYSBUF_FD_CACHE 64
+
+// Guest writes coalesced in a host buffer, all of them to the same fd
+typedef struct {
+    // -1 when the buffer is empty
+    int fd;
+    uint64_t size;
+    // errno of a flush that failed after its writes returned, handed to the next write on [error_fd]
+    int error_fd;
+    int error;
+    uint64_t guest_syscalls;
+    uint64_t host_syscalls;
+    // SYSBUF_FD_* flags, 0 when nothing is known
+    uint8_t fds[SYSBUF_FD_CACHE];
+    uint8_t data[SYSBUF_SIZE];
+} vm_sysbuf_t;
+
+vm_sysbuf_t* sysbuf_create();
+// Result of write(fd, data, size) for the guest, the bytes may still be in the buffer
+int64_t sysbuf_write(vm_sysbuf_t* buffer, int fd, const uint8_t* data, uint64_t size);
+void sysbuf_flush(vm_sysbuf_t* buffer);
+// True once per flush error that no write reported, for a guest that halts before writing again
+bool_t sysbuf_take_error(vm_sysbuf_t* buffer);
+// [fd] was closed or replaced, what was cached about it is stale
+void sysbuf_forget(vm_sysbuf_t* buffer, int fd);
+// Counters and fd cache start again for the next request, bytes a flush could not write are dropped
+void sysbuf_reset(vm_sysbuf_t* buffer);
+void free_sysbuf(vm_sysbuf_t* buffer);
+
+#endif
@@ -26,6 +26,13 @@ double double_of_bits(uint64_t t){
     return *ptr;
 }
 
+uint64_t fnv1a(const void* data, uint64_t size, uint64_t hash) {
+    const uint8_t* bytes = data;
+    for (uint64_t i = 0; i < size; i += 1) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
 
 void failwith(const char* message, int code) {
     puts(message);
@@ -12,6 +12,7 @@ uint64_t alignn(uint64_t size, uint64_t to);
 uint64_t align8(uint64_t size);
 uint64_t bits_of_double(double d);
 double double_of_bits(uint64_t t);
+uint64_t fnv1a(const void* data, uint64_t size, uint64_t hash);
 void failwith(const char* message, int code);
 
 
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
@@ -65,21 +66,90 @@ int show_status(vm_t* vm) {
     show_reg("f2", vm->fr2, true);
     show_reg("f3", vm->fr3, true);
     show_reg("f4", vm->fr4, true);
+    printf("syscalls = %llu guest, %llu host\n",
+        (unsigned long long) vm->sysbuf->guest_syscalls, (unsigned long long) vm->sysbuf->host_syscalls
+    );
 
 
     return 0;
 }
 
-vm_t* vm_init(const instruction_t *const code, uint64_t stack_size, uint64_t offset) {
+void vm_syscall_counts(const vm_t* vm, uint64_t* guest, uint64_t* host) {
+    *guest = vm->sysbuf->guest_syscalls;
+    *host = vm->sysbuf->host_syscalls;
+}
+
+vm_t* vm_init(const instruction_t *const code, uint64_t count, uint64_t stack_size, uint64_t offset) {
     vm_t* vm_ptr = malloc(sizeof(vm_t));
-    if (!vm_ptr) failwith("Vm alloc fail", 1);
+    if (!vm_ptr) return NULL;
     vm_stack_t* stack = stack_create(stack_size);
-    const instruction_t* ip = code + offset;
-    vm_t vm = {.stack = stack, .code = code, .ip = ip, .fp = stack->sp, .last_cmp = false};
+    branch_cache_t* branch_cache = branch_cache_create();
+    vm_sysbuf_t* sysbuf = sysbuf_create();
+    if (!stack || !branch_cache || !sysbuf) {
+        if (stack) free_stack(stack);
+        free_branch_cache(branch_cache);
+        free(sysbuf);
+        free(vm_ptr);
+        return NULL;
+    }
+    const instruction_t* ip = code ? code + offset : NULL;
+    vm_t vm = {
+        .stack = stack, .branch_cache = branch_cache, .sysbuf = sysbuf, .code = code, .code_count = code ? count : 0,
+        .ip = ip, .fp = stack->sp, .last_cmp = false
+    };
     memcpy(vm_ptr, &vm, sizeof(vm_t));
     return vm_ptr;
 }
 
+void vm_reset(vm_t* vm) {
+    // One report per request, the next one starts from zero
+    if (vm->cachesim && vm->cachesim->total.accesses) {
+        cachesim_report(vm->cachesim, stderr);
+        cachesim_reset(vm->cachesim);
+    }
+    stack_reset(vm->stack);
+    heap_reset(&vm->heap);
+    // The previous request's output is complete before the next one starts
+    sysbuf_flush(vm->sysbuf);
+    sysbuf_reset(vm->sysbuf);
+    // Caches are keyed by instruction words or code addresses, they stay valid across requests
+    vm_t vm_clear = {
+        .stack = vm->stack, .branch_cache = vm->branch_cache, .sysbuf = vm->sysbuf, .code = vm->code,
+        .code_count = vm->code_count, .ip = vm->code, .fp = vm->stack->sp, .last_cmp = false
+    };
+    memcpy(vm_clear.div_cache, vm->div_cache, sizeof(vm->div_cache));
+    vm_clear.heap = vm->heap;
+    vm_clear.image = vm->image;
+    vm_clear.cachesim = vm->cachesim;
+    vm_clear.profile = vm->profile;
+    memcpy(vm, &vm_clear, sizeof(vm_t));
+}
+
+// [map] translates the register branch offsets of a compressed program, NULL otherwise
+void load_code(vm_t* vm, const instruction_t *const code, uint64_t count, const uint64_t* map, uint64_t map_size, uint64_t offset) {
+    if (code != vm->code || count != vm->code_count) branch_cache_reset(vm->branch_cache);
+    branch_cache_set_map(vm->branch_cache, map, map_size);
+    memcpy((void *) &vm->code, &code, sizeof(code));
+    vm->code_count = count;
+    vm->ip = code + offset;
+    vm->image = NULL;
+}
+
+void vm_load(vm_t* vm, const instruction_t *const code, uint64_t count, uint64_t offset) {
+    load_code(vm, code, count, NULL, 0, offset);
+}
+
+void vm_load_program(vm_t* vm, const vm_program_t* program, uint64_t offset) {
+    // Register branches of a compressed program hold parcel offsets
+    load_code(vm, program->code, program->count, program->parcel_map, program->parcel_count, offset);
+}
+
+void vm_load_image(vm_t* vm, const prepared_image_t* image, uint64_t offset) {
+    // Images hold expanded code, their register branches use instruction offsets
+    load_code(vm, image->code, image->count, NULL, 0, offset);
+    vm->image = image;
+}
+
 instruction_t fetch_instruction(vm_t* vm) {
     return *(vm->ip++);
 }
@@ -87,8 +157,8 @@ instruction_t fetch_instruction(vm_t* vm) {
 int64_t sext25(instruction_t instruction) {
     const uint32_t seven_first_mask = 0xFE000000;
     const uint32_t litteral = instruction & (~seven_first_mask);
-    if (is_set(instruction, mask_bit(25))) {
-        return seven_first_mask | litteral;
+    if (is_set(instruction, mask_bit(24))) {
+        return (int32_t) (seven_first_mask | litteral);
     } else {
         return litteral;
     }
@@ -100,7 +170,7 @@ int64_t sext22(instruction_t instruction) {
     const uint32_t litteral = instruction & (~ten_first_mask);
 
     if (is_set(litteral, bits_22_mask)) {
-        return ten_first_mask | litteral;
+        return (int32_t) (ten_first_mask | litteral);
     } else {
         return litteral;
     }
@@ -112,18 +182,18 @@ int64_t sext21(instruction_t instruction) {
     const uint32_t litteral = instruction & (~eleven_first_mask);
 
     if (is_set(litteral, bits_20_mask)) {
-        return eleven_first_mask | litteral;
+        return (int32_t) (eleven_first_mask | litteral);
     } else {
         return litteral;
     }
 }
 
 int64_t sext18(instruction_t instruction, bool_t is_signed_extend) {
-    const uint32_t fourteen_first_mask = 0xFFFA0000;
+    const uint32_t fourteen_first_mask = 0xFFFC0000;
     const uint32_t litteral = instruction & ~fourteen_first_mask;
 
     if (is_set(instruction, mask_bit(17))) {
-        return fourteen_first_mask | litteral;
+        return (int32_t) (fourteen_first_mask | litteral);
     } else {
         return litteral;
     }
@@ -134,24 +204,34 @@ int64_t sext16(instruction_t instruction) {
     const uint32_t litteral = instruction & ~sixteen_first_mask;
 
     if (is_set(instruction, mask_bit(15))) {
-        return sixteen_first_mask | litteral;
+        return (int32_t) (sixteen_first_mask | litteral);
+    } else {
+        return litteral;
+    }
+}
+
+int64_t sext15(instruction_t instruction) {
+    const uint32_t seventeen_first_mask = 0xFFFF8000;
+    const uint32_t litteral = instruction & ~seventeen_first_mask;
+    if (is_set(instruction, mask_bit(14))) {
+        return (int32_t) (seventeen_first_mask | litteral);
     } else {
         return litteral;
     }
 }
 
 int64_t sext14(instruction_t instruction) {
-    const uint32_t eigthteen_first_mask = 0xFFFF8000;
+    const uint32_t eigthteen_first_mask = 0xFFFFC000;
     const uint32_t litteral = instruction & ~eigthteen_first_mask;
     if (is_set(instruction, mask_bit(13))) {
-        return eigthteen_first_mask | litteral;
+        return (int32_t) (eigthteen_first_mask | litteral);
     } else {
         return litteral;
     }
 }
 
-reg_t* register_of_int32(vm_t* vm, uint32_t bits, uint32_t shift) {
-    switch ((bits >> shift) & REG_ONLY_MASK) {
+reg_t* register_of_index(vm_t* vm, uint32_t index) {
+    switch (index) {
     case 0:
         return &vm->r0;
     case 1:
@@ -185,13 +265,78 @@ reg_t* register_of_int32(vm_t* vm, uint32_t bits, uint32_t shift) {
     case 15:
         return &vm->fr7; 
     default:
-        failwith("Wrong register number", 1);
+        vm->fault = "Wrong register number";
+        return &vm->scratch;
     }
-    return (void *) 0;
+}
+
+reg_t* register_of_int32(vm_t* vm, uint32_t bits, uint32_t shift) {
+    return register_of_index(vm, (bits >> shift) & REG_ONLY_MASK);
+}
+
+void trace_access(vm_t* vm, reg_t address, data_size_t ds, translation_kind_t kind) {
+    uint64_t ip = vm->ip - 1 - vm->code;
+    reg_t region = 0;
+    const char* name;
+    if (kind == MAPPED) {
+        region = vm->mappings.entries[vm->mappings.last].guest_address;
+        name = region == (reg_t) vm->heap.arena ? "heap" : "mapping";
+    } else {
+        region = (reg_t) vm->code;
+        name = "code";
+    }
+    cachesim_access(vm->cachesim, ip, address, 1 << ds, region, name);
+}
+
+// An unmapped address faults, except for reads of the code whose addresses lea hands out
+uint8_t* host_address(vm_t* vm, translation_kind_t kind, reg_t address, uint64_t size, vm_prot_t access, uint8_t* host) {
+    switch (kind) {
+    case MAPPED:
+        return host;
+    case UNMAPPED: {
+        uint64_t code_size = vm->code_count * sizeof(instruction_t);
+        reg_t offset = address - (reg_t) vm->code;
+        if (access == VM_PROT_READ && offset < code_size && size <= code_size - offset) return (uint8_t*) address;
+        break;
+    }
+    case FAULT:
+        break;
+    }
+    return NULL;
+}
+
+uint8_t* data_address(vm_t* vm, reg_t address, data_size_t ds, vm_prot_t access) {
+    uint8_t* host = NULL;
+    translation_kind_t kind = mapping_translate(&vm->mappings, address, 1 << ds, access, &host);
+    uint8_t* result = host_address(vm, kind, address, 1 << ds, access, host);
+    if (vm->cachesim && result) trace_access(vm, address, ds, kind);
+    return result;
+}
+
+uint8_t* guest_range(vm_t* vm, reg_t address, uint64_t size, vm_prot_t access) {
+    uint8_t* host = NULL;
+    translation_kind_t kind = mapping_translate(&vm->mappings, address, size, access, &host);
+    return host_address(vm, kind, address, size, access, host);
 }
 
 int isyscall(vm_t* vm, instruction_t instruction) {
+    if (vm->sc == SYS_write) {
+        const uint8_t* data = guest_range(vm, vm->r1, vm->r2, VM_PROT_READ);
+        vm->r0 = data ? sysbuf_write(vm->sysbuf, (int) vm->r0, data, vm->r2) : (reg_t) -1;
+        return 0;
+    }
 
+    // Anything else may read, seek or close what the buffered writes target
+    sysbuf_flush(vm->sysbuf);
+    if (vm->sc == SYS_close) sysbuf_forget(vm->sysbuf, (int) vm->r0);
+    #ifdef SYS_dup2
+        if (vm->sc == SYS_dup2) sysbuf_forget(vm->sysbuf, (int) vm->r1);
+    #endif
+    #ifdef SYS_dup3
+        if (vm->sc == SYS_dup3) sysbuf_forget(vm->sysbuf, (int) vm->r1);
+    #endif
+    vm->sysbuf->guest_syscalls += 1;
+    vm->sysbuf->host_syscalls += 1;
     #ifndef __APPLE__
         vm->r0 = __syscall(vm->sc, vm->r0, vm->r1, vm->r2, vm->r3, vm->r4, vm->r5);
     #else
@@ -202,11 +347,195 @@ int isyscall(vm_t* vm, instruction_t instruction) {
     return 0;
 }
 
+// The heap arena is mapped at its own host address so guest pointers need no translation
+void heap_map(vm_t* vm) {
+    if (vm->heap_mapped || !vm->heap.arena) return;
+    reg_t arena = (reg_t) vm->heap.arena;
+    vm->heap_mapped = mapping_add(&vm->mappings, vm->heap.arena, vm->heap.capacity, arena, VM_PROT_RW);
+}
+
+vm_channel_t* channel_of_handle(vm_t* vm, reg_t handle) {
+    return handle < VM_MAX_CHANNELS ? vm->channels[handle] : NULL;
+}
+
+// Describes the guest range for a send, false when it cannot be sent. The heap and the stack
+// are recycled by vm_reset while the receiver may still use them, so only host owned memory
+// is handed off and the other large messages travel in a copy the receiver takes over
+bool_t guest_message(vm_t* vm, reg_t address, uint64_t size, channel_message_t* message) {
+    message->data = guest_range(vm, address, size, VM_PROT_READ);
+    message->size = size;
+    message->writable = guest_range(vm, address, size, VM_PROT_WRITE) != NULL;
+    message->owned = false;
+    if (!message->data) return false;
+    if (size <= CHANNEL_INLINE_SIZE) return true;
+
+    reg_t host = (reg_t) message->data;
+    reg_t heap = (reg_t) vm->heap.arena;
+    reg_t stack = (reg_t) vm->stack->memory;
+    bool_t in_heap = heap && host < heap + vm->heap.capacity && host + size > heap;
+    bool_t in_stack = host < stack + vm->stack->mapped_size && host + size > stack;
+    if (!in_heap && !in_stack) return true;
+
+    uint8_t* copy = malloc(size);
+    if (!copy) return false;
+    memcpy(copy, message->data, size);
+    message->data = copy;
+    message->writable = true;
+    message->owned = true;
+    return true;
+}
+
+// Status in r0: 0 done, 1 would block, -1 error
+void channel_send(vm_t* vm, vm_channel_t* channel) {
+    channel_message_t message;
+    if (!guest_message(vm, vm->r1, vm->r2, &message)) {
+        vm->r0 = -1;
+        return;
+    }
+    while (channel_try_send(channel, &message) == CHANNEL_WOULD_BLOCK) {
+        sched_yield();
+    }
+    vm->r0 = 0;
+}
+
+void channel_send_batch(vm_t* vm, vm_channel_t* channel) {
+    // Array of r2 (address, size) pairs at r1
+    reg_t count = vm->r2;
+    const reg_t* descriptors = (const reg_t*) guest_range(vm, vm->r1, count * 2 * sizeof(reg_t), VM_PROT_READ);
+    if (!descriptors || count > UINT64_MAX / (2 * sizeof(reg_t))) {
+        vm->r0 = -1;
+        return;
+    }
+
+    channel_message_t messages[16];
+    reg_t sent = 0;
+    while (sent < count) {
+        uint64_t chunk = count - sent < 16 ? count - sent : 16;
+        for (uint64_t i = 0; i < chunk; i += 1) {
+            const reg_t* descriptor = &descriptors[(sent + i) * 2];
+            if (!guest_message(vm, descriptor[0], descriptor[1], &messages[i])) {
+                // Nothing of this chunk was sent, its copies go away with it
+                for (uint64_t j = 0; j < i; j += 1) {
+                    if (messages[j].owned) free((void *) messages[j].data);
+                }
+                vm->r0 = -1;
+                vm->r1 = sent;
+                return;
+            }
+        }
+        uint64_t pushed = 0;
+        while (pushed < chunk) {
+            uint64_t n = channel_try_send_batch(channel, messages + pushed, chunk - pushed);
+            if (n == 0) sched_yield();
+            pushed += n;
+        }
+        sent += chunk;
+    }
+    vm->r0 = 0;
+    vm->r1 = sent;
+}
+
+// Receives in the buffer (r1, r2), the message is then at r1 with r2 bytes. Handed off memory
+// is mapped in this vm at its host address, read only unless the sender could write it, and a
+// copy is moved to the heap
+void channel_receive(vm_t* vm, vm_channel_t* channel, bool_t is_blocking) {
+    uint8_t* buffer = guest_range(vm, vm->r1, vm->r2, VM_PROT_WRITE);
+    if (!buffer) {
+        vm->r0 = -1;
+        return;
+    }
+
+    channel_message_t message;
+    channel_status_t status;
+    while ((status = channel_try_receive(channel, buffer, vm->r2, &message)) == CHANNEL_WOULD_BLOCK && is_blocking) {
+        sched_yield();
+    }
+    if (status != CHANNEL_OK) {
+        vm->r0 = status == CHANNEL_WOULD_BLOCK ? 1 : -1;
+        return;
+    }
+
+    if (message.owned) {
+        uint8_t* block = heap_alloc(&vm->heap, message.size);
+        heap_map(vm);
+        if (block) memcpy(block, message.data, message.size);
+        free((void *) message.data);
+        if (!block) {
+            vm->r0 = -1;
+            return;
+        }
+        vm->r1 = (reg_t) block;
+    } else if (message.data != buffer) {
+        reg_t address = (reg_t) message.data;
+        uint8_t* host;
+        vm_prot_t prot = message.writable ? VM_PROT_RW : VM_PROT_READ;
+        // The guest reaches the memory at its host address, which may already be taken by another mapping
+        translation_kind_t kind = mapping_translate(&vm->mappings, address, message.size, prot, &host);
+        bool_t reachable = kind == MAPPED && host == message.data;
+        if (kind == UNMAPPED) reachable = mapping_add(&vm->mappings, (void *) message.data, message.size, address, prot);
+        if (!reachable) {
+            vm->r0 = -1;
+            return;
+        }
+        vm->r1 = address;
+    }
+    vm->r0 = 0;
+    vm->r2 = message.size;
+}
+
+int icall(vm_t* vm, instruction_t instruction) {
+    bool_t is_register = is_set(instruction, mask_bit(24));
+    if (is_register) return 0;
+
+    bool_t valid = true;
+    switch (instruction & 0xFFFFFF) {
+    case VM_CALL_ALLOC:
+        vm->r0 = (reg_t) heap_alloc(&vm->heap, vm->r0);
+        heap_map(vm);
+        break;
+    case VM_CALL_FREE:
+        valid = heap_free(&vm->heap, (void *) vm->r0);
+        break;
+    case VM_CALL_REALLOC:
+        vm->r0 = (reg_t) heap_realloc(&vm->heap, (void *) vm->r0, vm->r1, &valid);
+        heap_map(vm);
+        break;
+    case VM_CALL_CHANNEL_SEND:
+    case VM_CALL_CHANNEL_SEND_BATCH:
+    case VM_CALL_CHANNEL_RECEIVE:
+    case VM_CALL_CHANNEL_TRY_RECEIVE: {
+        vm_channel_t* channel = channel_of_handle(vm, vm->r0);
+        uint32_t fn = instruction & 0xFFFFFF;
+        if (!channel) {
+            vm->r0 = -1;
+        } else if (fn == VM_CALL_CHANNEL_SEND) {
+            channel_send(vm, channel);
+        } else if (fn == VM_CALL_CHANNEL_SEND_BATCH) {
+            channel_send_batch(vm, channel);
+        } else {
+            channel_receive(vm, channel, fn == VM_CALL_CHANNEL_RECEIVE);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    if (!valid) vm->fault = "Invalid heap pointer";
+    return 0;
+}
+
 int halt_opcode(vm_t* vm, instruction_t instruction, bool_t* halt) {
     if (halt) *halt = false;
     switch ((instruction >> 25) & 0x3) {
         case HALT: {
             if (halt) *halt = true;
+            // The guest can no longer see an error of its buffered writes, the host does
+            sysbuf_flush(vm->sysbuf);
+            if (sysbuf_take_error(vm->sysbuf)) {
+                vm->fault = "Buffered write failed";
+                return -1;
+            }
             return 0;
         }
         case RET_BITS: {
@@ -218,7 +547,7 @@ int halt_opcode(vm_t* vm, instruction_t instruction, bool_t* halt) {
         }
 
         case CALL_BITS: {
-            return 0;
+            return icall(vm, instruction);
         }
     }
 
@@ -280,6 +609,7 @@ int mva(vm_t* vm, instruction_t instruction) {
 }
 
 int br(vm_t* vm, instruction_t instruction) {
+    const instruction_t* site = vm->ip - 1;
     bool_t is_branch_link = is_set(instruction, mask_bit(26));
     bool_t is_register = is_set(instruction, mask_bit(25));
     if (is_register) {
@@ -287,7 +617,12 @@ int br(vm_t* vm, instruction_t instruction) {
        if (is_branch_link) {
             vm->fp = (reg_t) vm->ip;
        }
-       vm->ip = vm->code + *src;
+       const instruction_t* target = branch_cache_lookup(vm->branch_cache, vm->code, vm->code_count, site, *src);
+       if (!target) {
+            vm->fault = "Invalid branch target";
+            return -1;
+       }
+       vm->ip = target;
     } else {
         int64_t value = sext25(instruction);
         if (is_branch_link) {
@@ -296,6 +631,7 @@ int br(vm_t* vm, instruction_t instruction) {
         vm->ip = vm->ip + value;
     }
 
+    if (vm->profile) profile_record(vm->profile, site - vm->code, vm->ip - vm->code, 1);
     return 0;
 }
 
@@ -357,12 +693,51 @@ int mult(vm_t* vm, instruction_t instruction) {
     return 0;
 }
 
+// The litteral of udiv/umod is zero extended, a sign extended one would be a divisor near 2^64
+int64_t div_litteral(instruction_t instruction) {
+    if (is_set(instruction, mask_bit(26))) return instruction & 0x7FFF;
+    return sext15(instruction);
+}
+
+const div_magic_t* div_magic_of(vm_t* vm, instruction_t instruction) {
+    div_cache_entry_t* entry = &vm->div_cache[(instruction * 0x9E3779B1u) >> 26];
+    if (entry->instruction != instruction) {
+        bool_t is_unsigned = is_set(instruction, mask_bit(26));
+        int64_t value = div_litteral(instruction);
+        entry->magic = is_unsigned ? udiv_magic(value) : sdiv_magic(value);
+        entry->instruction = instruction;
+    }
+    return &entry->magic;
+}
+
 int idiv(vm_t* vm, instruction_t instruction) {
-    return -1;
+    bool_t is_unsigned = is_set(instruction, mask_bit(26));
+    reg_t* dst = register_of_int32(vm, instruction, 21);
+    reg_t* src = register_of_int32(vm, instruction, 16);
+    bool_t is_register = is_set(instruction, mask_bit(15));
+    if (is_register) {
+        reg_t* src2 = register_of_int32(vm, instruction, 10);
+        *dst = is_unsigned ? udiv64(*src, *src2) : sdiv64(*src, *src2);
+    } else {
+        const div_magic_t* magic = div_magic_of(vm, instruction);
+        *dst = is_unsigned ? udiv_magic_do(*src, magic) : sdiv_magic_do(*src, magic);
+    }
+    return 0;
 }
 
 int mod(vm_t* vm, instruction_t instruction) {
-    return -1;
+    bool_t is_unsigned = is_set(instruction, mask_bit(26));
+    reg_t* dst = register_of_int32(vm, instruction, 21);
+    reg_t* src = register_of_int32(vm, instruction, 16);
+    bool_t is_register = is_set(instruction, mask_bit(15));
+    if (is_register) {
+        reg_t* src2 = register_of_int32(vm, instruction, 10);
+        *dst = is_unsigned ? umod64(*src, *src2) : smod64(*src, *src2);
+    } else {
+        const div_magic_t* magic = div_magic_of(vm, instruction);
+        *dst = is_unsigned ? umod_magic_do(*src, magic) : smod_magic_do(*src, magic);
+    }
+    return 0;
 }
 
 
@@ -496,67 +871,268 @@ int cmp(vm_t* vm, instruction_t instruction) {
     return 0;
 }
 
-int ldr(vm_t* vm, instruction_t instruction) {
-    data_size_t ds = (instruction >> 24) & DATA_SIZE_MASK;
-    reg_t* dst = register_of_int32(vm, instruction, 19);
-    reg_t* base = register_of_int32(vm, instruction, 14);
-    int64_t offset = sext14(instruction);
+int load_data(vm_t* vm, reg_t* dst, reg_t address, data_size_t ds) {
+    uint8_t* host = data_address(vm, address, ds, VM_PROT_READ);
+    if (!host) return -1;
+    // Guest addresses have no alignment requirement
     switch (ds) {
     case S8:
-        *dst = *((uint8_t*) base + offset);
+        *dst = *host;
         break;
-    case S16:
-        *dst = *((uint16_t*) base + offset);
+    case S16: {
+        uint16_t value;
+        memcpy(&value, host, sizeof(value));
+        *dst = value;
         break;
-    case S32:
-        *dst = *((uint32_t*) base + offset);
+    }
+    case S32: {
+        uint32_t value;
+        memcpy(&value, host, sizeof(value));
+        *dst = value;
+        break;
+    }
+    case S64: {
+        uint64_t value;
+        memcpy(&value, host, sizeof(value));
+        *dst = value;
         break;
-    case S64:
-        *dst = *((uint64_t*) base + offset);
-      break;
+    }
     }
 
     return 0;
 }
 
-int str(vm_t* vm, instruction_t instruction) {
-    data_size_t ds = (instruction >> 24) & DATA_SIZE_MASK;
-    reg_t* src = register_of_int32(vm, instruction, 19);
-    reg_t* base = register_of_int32(vm, instruction, 14);
-    int64_t offset = sext14(instruction);
+int store_data(vm_t* vm, reg_t value, reg_t address, data_size_t ds) {
+    uint8_t* host = data_address(vm, address, ds, VM_PROT_WRITE);
+    if (!host) return -1;
     switch (ds) {
     case S8:
-        *((uint8_t*) base + offset) = (uint8_t) *src;
+        *host = (uint8_t) value;
         break;
-    case S16:
-        *((uint16_t*) base + offset) = (uint16_t) *src;
+    case S16: {
+        uint16_t narrow = (uint16_t) value;
+        memcpy(host, &narrow, sizeof(narrow));
         break;
-    case S32:
-        *((uint32_t*) base + offset) = (uint32_t) *src;
+    }
+    case S32: {
+        uint32_t narrow = (uint32_t) value;
+        memcpy(host, &narrow, sizeof(narrow));
         break;
+    }
     case S64:
-        *((uint64_t*) base + offset) = (uint64_t) *src;
+        memcpy(host, &value, sizeof(value));
         break;
     }
 
     return 0;
 }
 
+int ldr(vm_t* vm, instruction_t instruction) {
+    data_size_t ds = (instruction >> 24) & DATA_SIZE_MASK;
+    reg_t* dst = register_of_int32(vm, instruction, 19);
+    reg_t* base = register_of_int32(vm, instruction, 14);
+    int64_t offset = sext14(instruction);
+    return load_data(vm, dst, *base + ((reg_t) offset << ds), ds);
+}
+
+int str(vm_t* vm, instruction_t instruction) {
+    data_size_t ds = (instruction >> 24) & DATA_SIZE_MASK;
+    reg_t* src = register_of_int32(vm, instruction, 19);
+    reg_t* base = register_of_int32(vm, instruction, 14);
+    int64_t offset = sext14(instruction);
+    return store_data(vm, *src, *base + ((reg_t) offset << ds), ds);
+}
+
 int ldr_str(vm_t* vm, instruction_t instruction) {
     bool_t is_str = is_set(instruction, mask_bit(26));
     return is_str ? str(vm, instruction) : ldr(vm, instruction);
 }
 
-int vm_run(vm_t* vm){
+#define register_field(instruction, shift) \
+    (((instruction) >> (shift)) & REG_ONLY_MASK)
+
+void prepare_operand(prepared_instruction_t* prepared, instruction_t instruction, uint32_t flag_bit, uint32_t rhs_shift, int64_t immediate) {
+    if (is_set(instruction, mask_bit(flag_bit))) {
+        prepared->flags |= PREPARED_REGISTER;
+        prepared->rhs = register_field(instruction, rhs_shift);
+    } else {
+        prepared->immediate = immediate;
+    }
+}
+
+// Decodes once what the handlers decode at each execution.
+// Forms left without PREPARED_VALID keep going through the handlers
+void vm_prepare_instruction(instruction_t instruction, uint64_t index, uint64_t count, prepared_instruction_t* prepared) {
+    memset(prepared, 0, sizeof(prepared_instruction_t));
+    prepared->instruction = instruction;
+    prepared->opcode = opcode_value(instruction);
+    switch (prepared->opcode) {
+    case MVNOT:
+    case MVNEG:
+    case MOV:
+        prepared->dst = register_field(instruction, 22);
+        prepare_operand(prepared, instruction, 21, 16, sext21(instruction));
+        break;
+    case BR_JUMP: {
+        // Register branches are resolved by the branch cache
+        if (is_set(instruction, mask_bit(25))) return;
+        int64_t target = (int64_t) index + 1 + sext25(instruction);
+        if (target < 0 || (uint64_t) target >= count) return;
+        if (is_set(instruction, mask_bit(26))) prepared->flags |= PREPARED_LINK;
+        prepared->immediate = target;
+        break;
+    }
+    case ADD:
+    case SUB:
+    case MULT:
+    case AND:
+    case OR:
+    case XOR:
+    case LSL:
+    case LSR:
+    case ASR:
+        prepared->dst = register_field(instruction, 22);
+        prepared->lhs = register_field(instruction, 17);
+        prepare_operand(prepared, instruction, 16, 11, sext16(instruction));
+        break;
+    case DIV:
+    case MOD: {
+        bool_t is_unsigned = is_set(instruction, mask_bit(26));
+        prepared->dst = register_field(instruction, 21);
+        prepared->lhs = register_field(instruction, 16);
+        prepare_operand(prepared, instruction, 15, 10, div_litteral(instruction));
+        if (is_unsigned) prepared->flags |= PREPARED_UNSIGNED;
+        if (!(prepared->flags & PREPARED_REGISTER)) {
+            prepared->magic = is_unsigned ? udiv_magic(prepared->immediate) : sdiv_magic(prepared->immediate);
+        }
+        break;
+    }
+    case LDR:
+    case STR:
+        if (is_set(instruction, mask_bit(26))) prepared->flags |= PREPARED_STORE;
+        prepared->data_size = (instruction >> 24) & DATA_SIZE_MASK;
+        prepared->dst = register_field(instruction, 19);
+        prepared->lhs = register_field(instruction, 14);
+        prepared->immediate = sext14(instruction);
+        break;
+    default:
+        return;
+    }
+
+    // Invalid register numbers are reported by the handlers
+    if (prepared->dst < 16 && prepared->lhs < 16 && prepared->rhs < 16) {
+        prepared->flags |= PREPARED_VALID;
+    }
+}
+
+bool_t run_prepared(vm_t* vm, const prepared_instruction_t* prepared) {
+    if (!(prepared->flags & PREPARED_VALID)) return false;
+
+    reg_t* dst = register_of_index(vm, prepared->dst);
+    reg_t lhs = *register_of_index(vm, prepared->lhs);
+    bool_t is_register = prepared->flags & PREPARED_REGISTER;
+    bool_t is_unsigned = prepared->flags & PREPARED_UNSIGNED;
+    reg_t rhs = is_register ? *register_of_index(vm, prepared->rhs) : (reg_t) prepared->immediate;
+    switch (prepared->opcode) {
+    case MVNOT:
+        *dst = ~rhs;
+        break;
+    case MVNEG:
+        *dst = -rhs;
+        break;
+    case MOV:
+        *dst = rhs;
+        break;
+    case BR_JUMP:
+        if (prepared->flags & PREPARED_LINK) {
+            vm->fp = (reg_t) vm->ip;
+        }
+        if (vm->profile) profile_record(vm->profile, vm->ip - 1 - vm->code, prepared->immediate, 1);
+        vm->ip = vm->code + prepared->immediate;
+        break;
+    case ADD:
+        *dst = lhs + rhs;
+        break;
+    case SUB:
+        *dst = lhs - rhs;
+        break;
+    case MULT:
+        *dst = lhs * rhs;
+        break;
+    case AND:
+        *dst = lhs & rhs;
+        break;
+    case OR:
+        *dst = lhs | rhs;
+        break;
+    case XOR:
+        *dst = lhs ^ rhs;
+        break;
+    case LSL:
+        *dst = lhs << rhs;
+        break;
+    case LSR:
+        *dst = lhs >> rhs;
+        break;
+    case ASR:
+        *dst = ((int64_t) lhs) >> rhs;
+        break;
+    case DIV:
+        if (is_register) {
+            *dst = is_unsigned ? udiv64(lhs, rhs) : sdiv64(lhs, rhs);
+        } else {
+            *dst = is_unsigned ? udiv_magic_do(lhs, &prepared->magic) : sdiv_magic_do(lhs, &prepared->magic);
+        }
+        break;
+    case MOD:
+        if (is_register) {
+            *dst = is_unsigned ? umod64(lhs, rhs) : smod64(lhs, rhs);
+        } else {
+            *dst = is_unsigned ? umod_magic_do(lhs, &prepared->magic) : smod_magic_do(lhs, &prepared->magic);
+        }
+        break;
+    case LDR:
+    case STR: {
+        reg_t address = lhs + ((reg_t) prepared->immediate << prepared->data_size);
+        if (prepared->flags & PREPARED_STORE) {
+            if (store_data(vm, *dst, address, prepared->data_size)) vm->fault = "Store fault";
+        } else {
+            if (load_data(vm, dst, address, prepared->data_size)) vm->fault = "Load fault";
+        }
+        break;
+    }
+    default:
+        return false;
+    }
+    return true;
+}
+
+vm_return_t vm_return(int status, uint32_t op, const char* message) {
+    vm_return_t result = {.status = status, .reason = {.op = op, .message = message}};
+    return result;
+}
+
+vm_return_t vm_run(vm_t* vm){
+    opcode_t ist = HALT;
     while (true) {
+        // A bad branch offset must not make the host fetch from outside the code
+        if (vm->ip < vm->code || vm->ip >= vm->code + vm->code_count) {
+            return vm_return(-1, ist, "Invalid instruction address");
+        }
         instruction_t instruction = fetch_instruction(vm);
-        opcode_t ist = opcode_value(instruction);
+        ist = opcode_value(instruction);
+        uint64_t index = vm->ip - 1 - vm->code;
+        if (vm->image && index < vm->image->count && run_prepared(vm, &vm->image->instructions[index])) {
+            if (vm->fault) return vm_return(-1, ist, vm->fault);
+            show_status(vm);
+            continue;
+        }
         switch (ist) { 
             case HALT: {
                 bool_t b;
                 int status = halt_opcode(vm, instruction, &b);
                 if (b) {
-                    return status;
+                    return vm_return(status, ist, vm->fault);
                 } 
                 break;
             }
@@ -614,21 +1190,63 @@ int vm_run(vm_t* vm){
                 break;
             case LDR:
             case STR:
-                return ldr_str(vm, instruction);
+                if (ldr_str(vm, instruction)) {
+                    vm->fault = is_set(instruction, mask_bit(26)) ? "Store fault" : "Load fault";
+                }
                 break;
             default:
-                fprintf(stderr, "Unknown opcode %u\n", ist);
-                failwith("", 1);
+                return vm_return(-1, ist, "Unknown opcode");
             break;
         }
 
+        if (vm->fault) return vm_return(-1, ist, vm->fault);
         show_status(vm);
     }
-    return 0;
 }
 
 
+int vm_map_host_buffer(vm_t* vm, void* buffer, uint64_t size, reg_t guest_address, vm_prot_t prot) {
+    return mapping_add(&vm->mappings, buffer, size, guest_address, prot) ? 0 : -1;
+}
+
+int vm_unmap(vm_t* vm, reg_t guest_address) {
+    return mapping_remove(&vm->mappings, guest_address) ? 0 : -1;
+}
+
+int vm_attach_channel(vm_t* vm, vm_channel_t* channel) {
+    for (int handle = 0; handle < VM_MAX_CHANNELS; handle += 1) {
+        if (!vm->channels[handle]) {
+            vm->channels[handle] = channel;
+            return handle;
+        }
+    }
+    return -1;
+}
+
+int vm_enable_profile(vm_t* vm) {
+    if (!vm->profile) vm->profile = profile_create();
+    return vm->profile ? 0 : -1;
+}
+
+int vm_write_profile(vm_t* vm, const char* path) {
+    return vm->profile && profile_write(vm->profile, path) ? 0 : -1;
+}
+
+int vm_enable_cachesim(vm_t* vm, const cachesim_config_t* config) {
+    if (vm->cachesim) free_cachesim(vm->cachesim);
+    vm->cachesim = cachesim_create(config);
+    return vm->cachesim ? 0 : -1;
+}
+
 void free_vm(vm_t* vm){
+    if (vm->profile) free_profile(vm->profile);
+    if (vm->cachesim) {
+        if (vm->cachesim->total.accesses) cachesim_report(vm->cachesim, stderr);
+        free_cachesim(vm->cachesim);
+    }
+    free_sysbuf(vm->sysbuf);
     free_stack(vm->stack);
+    free_branch_cache(vm->branch_cache);
+    free_heap(&vm->heap);
     free(vm);
 }
\ No newline at end of file
@@ -2,7 +2,17 @@
 #define VM_H
 
 #include "vm_base.h"
+#include "branch_cache.h"
+#include "cachesim.h"
+#include "channel.h"
+#include "divmagic.h"
+#include "heap.h"
+#include "image.h"
+#include "mapping.h"
+#include "profile.h"
+#include "program.h"
 #include "stack.h"
+#include "sysbuf.h"
 #include "util.h"
 #include <stdint.h>
 
@@ -32,6 +42,20 @@ typedef enum {
 } opcode_t;
 
 
+// Reserved call numbers, arguments in r0 and r1, result in r0
+#define VM_CALL_ALLOC 0xFFFF00
+#define VM_CALL_FREE 0xFFFF01
+#define VM_CALL_REALLOC 0xFFFF02
+// r0 holds the channel handle. Messages over CHANNEL_INLINE_SIZE bytes in host buffers mapped
+// by vm_map_host_buffer are handed off, those in the heap or the stack are copied and the copy
+// lands in the heap of the receiver, which frees it with VM_CALL_FREE
+#define VM_CALL_CHANNEL_SEND 0xFFFF10
+#define VM_CALL_CHANNEL_RECEIVE 0xFFFF11
+#define VM_CALL_CHANNEL_TRY_RECEIVE 0xFFFF12
+#define VM_CALL_CHANNEL_SEND_BATCH 0xFFFF13
+
+#define VM_MAX_CHANNELS 8
+
 typedef enum {
     ALWAYS,
     EQUAL,
@@ -67,11 +91,40 @@ typedef struct vm_return_t {
     } reason;
 } vm_return_t;
 
+#define DIV_CACHE_SIZE 64
+
+// Magic numbers of the div/mod instructions with a litteral divisor
+typedef struct {
+    instruction_t instruction;
+    div_magic_t magic;
+} div_cache_entry_t;
+
 typedef struct {
     instruction_t const * const code;
+    // Number of instructions at [code], vm_run faults when ip leaves them
+    uint64_t code_count;
     bool_t last_cmp;
     const instruction_t* ip;
     vm_stack_t* stack;
+    // Decoded form of [code], optional
+    const prepared_image_t* image;
+    branch_cache_t* branch_cache;
+    // Coalesces the guest writes, flushed at halt, reset and free_vm
+    vm_sysbuf_t* sysbuf;
+    div_cache_entry_t div_cache[DIV_CACHE_SIZE];
+    vm_address_space_t mappings;
+    vm_heap_t heap;
+    // Fed with every ldr/str when enabled, reported by free_vm
+    cachesim_t* cachesim;
+    // Taken counts of br/jump when enabled, for the layout tool
+    vm_profile_t* profile;
+    // Attached by the host, indexed by the handle the guest passes in r0
+    vm_channel_t* channels[VM_MAX_CHANNELS];
+    bool_t heap_mapped;
+    // Set by an instruction that cannot complete, stops vm_run
+    const char* fault;
+    // Target of the writes done through an invalid register number
+    reg_t scratch;
     reg_t fp;
 
     // Register parameters
@@ -113,8 +166,29 @@ typedef struct {
 } vm_t;
 
 
-vm_t* vm_init(instruction_t const * const code, uint64_t stack_size, uint64_t offset); 
+vm_t* vm_init(instruction_t const * const code, uint64_t count, uint64_t stack_size, uint64_t offset); 
+// Zeroes the registers, rewinds the stack and drops the mappings and the channels, caches are kept.
+// Buffered guest output is flushed, the syscall counters and the cache simulator statistics start again
+void vm_reset(vm_t* vm);
+// vm_load and vm_load_image drop the parcel map of a previously loaded compressed program
+void vm_load(vm_t* vm, instruction_t const * const code, uint64_t count, uint64_t offset);
+void vm_load_program(vm_t* vm, const vm_program_t* program, uint64_t offset);
+void vm_load_image(vm_t* vm, const prepared_image_t* image, uint64_t offset);
+void vm_prepare_instruction(instruction_t instruction, uint64_t index, uint64_t count, prepared_instruction_t* prepared);
 int show_status(vm_t* vm);
-int vm_run(vm_t* vm);
+vm_return_t vm_run(vm_t* vm);
+// Syscalls the guest made and the host really issued since the last vm_reset, read them before vm_release
+void vm_syscall_counts(const vm_t* vm, uint64_t* guest, uint64_t* host);
+// Makes [buffer, buffer + size) visible to ldr/str at guest_address, the buffer stays owned by the caller
+int vm_map_host_buffer(vm_t* vm, void* buffer, uint64_t size, reg_t guest_address, vm_prot_t prot);
+int vm_unmap(vm_t* vm, reg_t guest_address);
+// Handle of the channel for the guest, -1 when every handle is taken.
+// Attached channels are dropped by vm_reset, and so by vm_release: attach them again per request
+int vm_attach_channel(vm_t* vm, vm_channel_t* channel);
+int vm_enable_profile(vm_t* vm);
+int vm_write_profile(vm_t* vm, const char* path);
+// NULL config for a default L1/L2/TLB model. The report of the accesses since the last one goes
+// to stderr on vm_reset, so once per request of a pool, and on free_vm
+int vm_enable_cachesim(vm_t* vm, const cachesim_config_t* config);
 void free_vm(vm_t* vm);
 #endif
\ No newline at end of file